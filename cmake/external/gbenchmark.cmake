@@ -0,0 +1,52 @@
+# Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+include (ExternalProject)
+
+find_package(Threads REQUIRED)
+
+set(GBENCHMARK_SOURCES_DIR ${BAZEL_THIRD_PARTY_DIR}/gbenchmark)
+set(GBENCHMARK_INSTALL_DIR ${BAZEL_THIRD_PARTY_DIR}/install/gbenchmark)
+set(GBENCHMARK_INCLUDE_DIR "${GBENCHMARK_INSTALL_DIR}/include" CACHE PATH "gbenchmark include directory." FORCE)
+set(GBENCHMARK_LIBRARIES "${GBENCHMARK_INSTALL_DIR}/lib/libbenchmark.a")
+
+ExternalProject_Add(
+    extern_gbenchmark
+    GIT_REPOSITORY "https://github.com/google/benchmark"
+    GIT_TAG "v1.4.1"
+    PREFIX          ${GBENCHMARK_SOURCES_DIR}
+    UPDATE_COMMAND  ""
+    CMAKE_ARGS      -DCMAKE_CXX_COMPILER=${CMAKE_CXX_COMPILER}
+                    -DCMAKE_C_COMPILER=${CMAKE_C_COMPILER}
+                    -DCMAKE_CXX_FLAGS=${CMAKE_CXX_FLAGS}
+                    -DCMAKE_C_FLAGS=${CMAKE_C_FLAGS}
+                    -DCMAKE_INSTALL_PREFIX=${GBENCHMARK_INSTALL_DIR}
+                    -DCMAKE_INSTALL_LIBDIR=${GBENCHMARK_INSTALL_DIR}/lib
+                    -DCMAKE_POSITION_INDEPENDENT_CODE=ON
+                    -DBENCHMARK_ENABLE_TESTING=OFF
+                    -DBENCHMARK_ENABLE_GTEST_TESTS=OFF
+                    -DCMAKE_BUILD_TYPE=${THIRD_PARTY_BUILD_TYPE}
+                    ${EXTERNAL_OPTIONAL_ARGS}
+    CMAKE_CACHE_ARGS -DCMAKE_INSTALL_PREFIX:PATH=${GBENCHMARK_INSTALL_DIR}
+                     -DCMAKE_INSTALL_LIBDIR:PATH=${GBENCHMARK_INSTALL_DIR}/lib
+                     -DCMAKE_POSITION_INDEPENDENT_CODE:BOOL=ON
+                     -DCMAKE_BUILD_TYPE:STRING=${THIRD_PARTY_BUILD_TYPE}
+)
+
+add_library(gbenchmark STATIC IMPORTED GLOBAL)
+set_property(TARGET gbenchmark PROPERTY IMPORTED_LOCATION ${GBENCHMARK_LIBRARIES})
+# The library runs benchmarks on threads of its own
+set_property(TARGET gbenchmark PROPERTY INTERFACE_LINK_LIBRARIES Threads::Threads)
+
+include_directories(${GBENCHMARK_INCLUDE_DIR})
+add_dependencies(gbenchmark extern_gbenchmark)
@@ -0,0 +1,243 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/backward_cache.h"
+
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "src/op_cache.h"
+
+DEFINE_bool(tape_cache_backward,
+            true,
+            "If set, Tape::Backward reuses the backward tape built for a "
+            "forward tape with the same structure.");
+DEFINE_int32(tape_backward_cache_capacity,
+             64,
+             "Number of distinct forward tapes whose backward tapes are "
+             "cached.");
+
+namespace paddle {
+namespace tape {
+
+namespace {
+
+// Suffix of the temporaries Tape::Backward accumulates gradients through
+const char kTempSuffix[] = "@RENAME@";
+
+// Variables of forward in order of first use
+std::vector<VariableHandle> ForwardVariables(const OpHandleList &forward) {
+  std::unordered_map<const Variable *, size_t> slots;
+  std::vector<VariableHandle> vars;
+  for (auto &op : forward) {
+    for (auto *args : {&op.inputs_, &op.outputs_}) {
+      for (auto &param2var : *args) {
+        for (auto &var : param2var.second) {
+          if (slots.emplace(var.get(), vars.size()).second) {
+            vars.push_back(var);
+          }
+        }
+      }
+    }
+  }
+  return vars;
+}
+
+}  // namespace
+
+std::string BackwardFingerprint(const OpHandleList &forward,
+                                const Variable *target) {
+  std::unordered_map<const Variable *, size_t> slots;
+  std::string key;
+  for (auto &op : forward) {
+    key.append(op.type_).append("|").append(AttributeFingerprint(op.attrs_));
+    size_t k = 0;
+    for (auto *args : {&op.inputs_, &op.outputs_}) {
+      key.append("|");
+      for (auto &param2var : *args) {
+        key.append(param2var.first).append("#");
+        for (auto &var : param2var.second) {
+          auto inserted = slots.emplace(var.get(), slots.size());
+          key.append(std::to_string(inserted.first->second));
+          // Overwritten in place since the op was recorded
+          if (args == &op.inputs_ &&
+              var->Version() != op.input_versions_[k++]) {
+            key.append("!");
+          }
+          if (inserted.second) {
+            AppendDescFingerprint(var->Desc(), &key);
+            if (var->StopGradient()) key.append("s");
+          }
+          key.append(";");
+        }
+      }
+    }
+    key.append("\n");
+  }
+  auto it = slots.find(target);
+  if (it == slots.end()) return "";
+  return key + "target " + std::to_string(it->second);
+}
+
+BackwardTemplate::BackwardTemplate(const OpHandleList &forward,
+                                   const OpHandleList &backward) {
+  std::unordered_map<const Variable *, Argument> known;
+  std::unordered_map<std::string, size_t> grad_slots;
+  std::vector<VariableHandle> vars = ForwardVariables(forward);
+  for (size_t i = 0; i < vars.size(); ++i) {
+    known[vars[i].get()] = Argument{Argument::kForward, i};
+  }
+  for (size_t i = 0; i < vars.size(); ++i) {
+    VariableHandle grad = vars[i]->ExistingGrad();
+    if (grad != nullptr && !known.count(grad.get())) {
+      known[grad.get()] = Argument{Argument::kGrad, i};
+      grad_slots[grad->Name()] = i;
+    }
+  }
+
+  auto argument = [&](const Variable *var) -> Argument {
+    auto it = known.find(var);
+    if (it != known.end()) return it->second;
+    // A temporary is named after the gradient it is summed into
+    std::string name = var->Name();
+    auto grad = grad_slots.find(name.substr(0, name.rfind(kTempSuffix)));
+    PADDLE_ENFORCE(grad != grad_slots.end(),
+                   "%s is not a Variable of the forward tape, a gradient, or "
+                   "a temporary of one",
+                   name);
+    Argument temp{Argument::kTemp, temp_grads_.size()};
+    temp_grads_.push_back(grad->second);
+    known[var] = temp;
+    return temp;
+  };
+  auto arguments = [&argument](const VariableHandleMap &args) {
+    Arguments result;
+    for (auto &param2var : args) {
+      result.emplace_back(param2var.first, std::vector<Argument>());
+      for (auto &var : param2var.second) {
+        result.back().second.push_back(argument(var.get()));
+      }
+    }
+    return result;
+  };
+
+  for (auto &op : backward) {
+    ops_.emplace_back();
+    Op &cached = ops_.back();
+    cached.type = op.type_;
+    cached.inputs = arguments(op.inputs_);
+    cached.outputs = arguments(op.outputs_);
+    cached.attrs = op.attrs_;
+    for (auto &param2var : op.outputs_) {
+      for (auto &var : param2var.second) {
+        cached.output_descs.push_back(*var->MutableDesc()->Proto());
+      }
+    }
+    for (auto *var : op.release_after_run_) {
+      cached.releases.push_back(argument(var));
+    }
+  }
+}
+
+void BackwardTemplate::Instantiate(const OpHandleList &forward,
+                                   OpHandleList *backward) const {
+  std::vector<VariableHandle> vars = ForwardVariables(forward);
+  std::vector<VariableHandle> grads(vars.size());
+  std::vector<VariableHandle> temps(temp_grads_.size());
+  std::function<VariableHandle(const Argument &)> resolve =
+      [&](const Argument &arg) -> VariableHandle {
+        if (arg.kind == Argument::kForward) return vars[arg.index];
+        if (arg.kind == Argument::kGrad) {
+          auto &grad = grads[arg.index];
+          if (grad == nullptr) grad = vars[arg.index]->Grad();
+          return grad;
+        }
+        auto &temp = temps[arg.index];
+        if (temp == nullptr) {
+          VariableHandle grad =
+              resolve(Argument{Argument::kGrad, temp_grads_[arg.index]});
+          temp.reset(new Variable(grad->Name() + kTempSuffix));
+        }
+        return temp;
+      };
+  auto bind = [&resolve](const Arguments &args) {
+    VariableHandleMap result;
+    for (auto &param2arg : args) {
+      auto &list = result[param2arg.first];
+      for (auto &arg : param2arg.second) {
+        list.push_back(resolve(arg));
+      }
+    }
+    return result;
+  };
+
+  for (auto &cached : ops_) {
+    backward->emplace_back(
+        cached.type, bind(cached.inputs), bind(cached.outputs), cached.attrs);
+    OpHandle &op = backward->back();
+    auto desc = cached.output_descs.begin();
+    for (auto &param2var : op.outputs_) {
+      for (auto &var : param2var.second) {
+        std::string name = var->Name();
+        *var->MutableDesc()->Proto() = *desc++;
+        var->MutableDesc()->Proto()->set_name(name);
+      }
+    }
+    for (auto &param2var : op.inputs_) {
+      for (auto &var : param2var.second) {
+        op.input_versions_.push_back(var->Version());
+      }
+    }
+    for (auto &arg : cached.releases) {
+      op.release_after_run_.push_back(resolve(arg).get());
+    }
+  }
+}
+
+BackwardCache &BackwardCache::Instance() {
+  static BackwardCache cache;
+  return cache;
+}
+
+std::shared_ptr<const BackwardTemplate> BackwardCache::Lookup(
+    const std::string &key) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto *cached = templates_.Find(key);
+  return cached == nullptr ? nullptr : *cached;
+}
+
+void BackwardCache::Insert(const std::string &key, BackwardTemplate backward) {
+  std::shared_ptr<const BackwardTemplate> cached(
+      new BackwardTemplate(std::move(backward)));
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (templates_
+          .Insert(key,
+                  std::move(cached),
+                  static_cast<size_t>(FLAGS_tape_backward_cache_capacity))
+          .second) {
+    VLOG(3) << "Caching backward tape #" << templates_.Size();
+  }
+}
+
+size_t BackwardCache::Size() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return templates_.Size();
+}
+
+}  // namespace tape
+}  // namespace paddle
@@ -0,0 +1,99 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <memory>
+#include <mutex>  // NOLINT
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "src/op_cache.h"
+#include "src/tape.h"
+
+namespace paddle {
+namespace tape {
+
+// Fingerprint of the structure of a forward tape to be differentiated for
+// target: the ops with their attributes, the layout of their arguments, and
+// the type, data type, shape, LoD level and stop_gradient of every Variable.
+// Empty if target is not used by the tape.
+std::string BackwardFingerprint(const OpHandleList &forward,
+                                const Variable *target);
+
+/*
+ * The backward tape built for a forward tape, with every argument
+ * expressed relative to the forward tape: the n-th Variable of the forward
+ * tape in order of first use, its gradient, or a temporary of the backward
+ * tape. The inferred VarDescs of the outputs are kept as well.
+ *
+ * Instantiate() rebuilds the backward tape for another forward tape with
+ * the same BackwardFingerprint, without GradOpMaker or shape inference.
+ */
+class BackwardTemplate {
+ public:
+  BackwardTemplate(const OpHandleList &forward, const OpHandleList &backward);
+
+  // Append the ops of the template, bound to the Variables of forward and
+  // to new temporaries, to backward
+  void Instantiate(const OpHandleList &forward, OpHandleList *backward) const;
+
+ private:
+  struct Argument {
+    enum Kind { kForward, kGrad, kTemp };
+    Kind kind;
+    size_t index;
+  };
+  using Arguments = std::vector<std::pair<std::string, std::vector<Argument>>>;
+
+  struct Op {
+    std::string type;
+    Arguments inputs;
+    Arguments outputs;
+    framework::AttributeMap attrs;
+    std::vector<framework::proto::VarDesc> output_descs;
+    std::vector<Argument> releases;
+  };
+
+  std::vector<Op> ops_;
+  // The forward Variable whose gradient every temporary accumulates into
+  std::vector<size_t> temp_grads_;
+};
+
+/*
+ * Process wide cache of BackwardTemplate keyed by BackwardFingerprint.
+ *
+ * At most FLAGS_tape_backward_cache_capacity templates are kept, the least
+ * recently used is evicted first, e.g. when every sequence length records
+ * a tape of its own. A template returned by Lookup() outlives its eviction.
+ */
+class BackwardCache {
+ public:
+  static BackwardCache &Instance();
+
+  // nullptr on miss
+  std::shared_ptr<const BackwardTemplate> Lookup(const std::string &key);
+  void Insert(const std::string &key, BackwardTemplate backward);
+
+  size_t Size();
+
+ private:
+  BackwardCache() = default;
+
+  std::mutex mutex_;
+  LruCache<std::shared_ptr<const BackwardTemplate>> templates_;
+};
+
+}  // namespace tape
+}  // namespace paddle
@@ -0,0 +1,169 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/constant_cache.h"
+
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "paddle/fluid/framework/tensor_util.h"
+#include "src/op_cache.h"
+
+DEFINE_bool(tape_cache_constants,
+            true,
+            "If set, deterministic ops without inputs, like fill_constant, "
+            "share the result of their first run.");
+DEFINE_int32(tape_constant_cache_capacity,
+             64,
+             "Number of distinct initializer results kept by the constant "
+             "cache.");
+
+namespace paddle {
+namespace tape {
+
+namespace {
+
+// Ops whose result differs between runs with the same inputs
+const std::unordered_set<std::string> &NonDeterministicOps() {
+  static const std::unordered_set<std::string> ops = {
+      "uniform_random",
+      "uniform_random_batch_size_like",
+      "gaussian_random",
+      "gaussian_random_batch_size_like",
+      "truncated_gaussian_random",
+      "dropout",
+      "random_crop",
+      "sampling_id",
+      "print"};
+  return ops;
+}
+
+// The LoDTensor of var if it has data
+const framework::LoDTensor *TensorOf(const Variable &var) {
+  if (!var.Var().IsInitialized() ||
+      !var.Var().IsType<framework::LoDTensor>()) {
+    return nullptr;
+  }
+  auto &tensor = var.Var().Get<framework::LoDTensor>();
+  return tensor.IsInitialized() ? &tensor : nullptr;
+}
+
+}  // namespace
+
+bool IsDeterministic(const OpHandle &op) {
+  return !NonDeterministicOps().count(op.type_) && !op.attrs_.count("seed");
+}
+
+ConstantCache &ConstantCache::Instance() {
+  static ConstantCache cache;
+  return cache;
+}
+
+std::string ConstantCache::Key(const OpHandle &op) {
+  if (!FLAGS_tape_cache_constants || !op.inputs_.empty() ||
+      op.outputs_.empty() || !IsDeterministic(op)) {
+    return "";
+  }
+
+  std::string outputs;
+  for (auto &param2var : op.outputs_) {
+    outputs += "|" + param2var.first + "#" +
+               std::to_string(param2var.second.size());
+    for (auto &var : param2var.second) {
+      if (var->Desc().GetType() != framework::proto::VarType::LOD_TENSOR) {
+        return "";
+      }
+      // An output bound to storage of its own, e.g. by a MemoryPlan or a
+      // ParameterStore, keeps it
+      if (TensorOf(*var) != nullptr && !var->SharesConstant()) return "";
+    }
+  }
+  return op.type_ + "|" + AttributeFingerprint(op.attrs_) + outputs;
+}
+
+bool ConstantCache::Lookup(const std::string &key, OpHandle *op) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto *cached = results_.Find(key);
+  if (cached == nullptr) return false;
+  auto result = cached->begin();
+  for (auto &param2var : op->outputs_) {
+    for (auto &var : param2var.second) {
+      var->InitializeVariable();
+      auto *tensor = var->MutableVar()->GetMutable<framework::LoDTensor>();
+      tensor->ShareDataWith(*result);
+      tensor->set_lod(result->lod());
+      var->SetSharesConstant(true);
+      ++result;
+    }
+  }
+  return true;
+}
+
+void ConstantCache::Insert(const std::string &key, const OpHandle &op) {
+  // The kernel may have written into memory that is reused, so the cache
+  // keeps copies of its own
+  std::vector<framework::LoDTensor> result;
+  for (auto &param2var : op.outputs_) {
+    for (auto &var : param2var.second) {
+      auto *tensor = TensorOf(*var);
+      if (tensor == nullptr) return;
+      result.emplace_back();
+      framework::TensorCopySync(*tensor, tensor->place(), &result.back());
+      result.back().set_lod(tensor->lod());
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto inserted = results_.Insert(
+      key,
+      std::move(result),
+      static_cast<size_t>(FLAGS_tape_constant_cache_capacity));
+  if (!inserted.second) return;
+  VLOG(3) << "Caching the result of " << op.type_;
+
+  auto result_it = inserted.first->begin();
+  for (auto &param2var : op.outputs_) {
+    for (auto &var : param2var.second) {
+      var->MutableVar()->GetMutable<framework::LoDTensor>()->ShareDataWith(
+          *result_it++);
+      var->SetSharesConstant(true);
+    }
+  }
+}
+
+bool ConstantCache::Holds(const Variable &var) {
+  return var.SharesConstant() && TensorOf(var) != nullptr;
+}
+
+void ConstantCache::Detach(Variable *var) {
+  bool holds = Holds(*var);
+  var->SetSharesConstant(false);
+  if (!holds) return;
+  auto *tensor = var->MutableVar()->GetMutable<framework::LoDTensor>();
+  framework::LoDTensor copy;
+  framework::TensorCopySync(*tensor, tensor->place(), &copy);
+  copy.set_lod(tensor->lod());
+  *tensor = copy;
+}
+
+size_t ConstantCache::Size() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return results_.Size();
+}
+
+}  // namespace tape
+}  // namespace paddle
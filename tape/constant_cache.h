@@ -0,0 +1,80 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <mutex>  // NOLINT
+#include <string>
+#include <vector>
+
+#include "paddle/fluid/framework/lod_tensor.h"
+#include "src/op_cache.h"
+#include "src/tape.h"
+
+namespace paddle {
+namespace tape {
+
+// Whether op computes the same outputs whenever it is run on the same inputs,
+// i.e. it is not a random op and has no seed attribute
+bool IsDeterministic(const OpHandle &op);
+
+/*
+ * Process wide cache of the results of initializers, i.e. deterministic ops
+ * without inputs like fill_constant.
+ *
+ * The outputs of an initializer are computed once per type and attributes.
+ * Later the outputs of the same op share the cached data instead of running
+ * the kernel. Random ops, ops with a seed attribute, and ops whose outputs
+ * already have storage of their own are never cached.
+ *
+ * The cached data must not change: an op, or an optimizer, writing a
+ * Variable first Detach()es it. Only writes made through the tape and the
+ * optimizers are guarded, code writing the tensor of a Variable through
+ * Variable::MutableVar() must Detach() it as well.
+ *
+ * Variable::SharesConstant() is set on every Variable bound to a cached
+ * result, and cleared wherever a Variable is given storage of its own, so
+ * Holds() and Detach() need no lock. It stays set when the result is
+ * evicted, the Variables sharing it are still guarded against each other.
+ *
+ * At most FLAGS_tape_constant_cache_capacity results are kept, the least
+ * recently used is evicted first, e.g. when the value of a fill_constant
+ * changes every step.
+ */
+class ConstantCache {
+ public:
+  static ConstantCache &Instance();
+
+  // Key of the result of op, empty if op can not be cached
+  std::string Key(const OpHandle &op);
+  // Bind the outputs of op to the cached result, return false on miss
+  bool Lookup(const std::string &key, OpHandle *op);
+  // Cache a copy of the outputs of op, which then share it
+  void Insert(const std::string &key, const OpHandle &op);
+
+  // Whether var shares the data of a cached, or evicted, result
+  bool Holds(const Variable &var);
+  // Give var a copy of its data if it shares the data of a cached result
+  void Detach(Variable *var);
+
+  size_t Size();
+
+ private:
+  ConstantCache() = default;
+
+  std::mutex mutex_;
+  LruCache<std::vector<framework::LoDTensor>> results_;
+};
+
+}  // namespace tape
+}  // namespace paddle
@@ -0,0 +1,207 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/cse.h"
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "src/constant_cache.h"
+#include "src/op_cache.h"
+
+DEFINE_bool(tape_cse,
+            false,
+            "If set, Tape::Forward runs an op only once when it is recorded "
+            "several times on the same inputs.");
+
+namespace paddle {
+namespace tape {
+
+const char kCseSource[] = "@CSE_SOURCE@";
+
+namespace {
+
+using Writers = std::unordered_map<const Variable *, std::vector<size_t>>;
+
+// Type, attributes, and identity and version of the inputs of op
+std::string Fingerprint(const OpHandle &op) {
+  std::string key = op.type_ + "|" + AttributeFingerprint(op.attrs_);
+  size_t k = 0;
+  for (auto &param2var : op.inputs_) {
+    key += "|" + param2var.first + "#";
+    for (auto &var : param2var.second) {
+      key += std::to_string(var->Id()) + "@" +
+             std::to_string(op.input_versions_[k++]) + ";";
+    }
+  }
+  for (auto &param2var : op.outputs_) {
+    key += "|" + param2var.first + "#" +
+           std::to_string(param2var.second.size());
+  }
+  return key;
+}
+
+// Whether op can be a common subexpression at all
+bool Eligible(const OpHandle &op, const Writers &writers) {
+  if (op.outputs_.empty() || IsEliminated(op) || !IsDeterministic(op)) {
+    return false;
+  }
+  for (auto &param2var : op.outputs_) {
+    for (auto &var : param2var.second) {
+      if (var->Desc().GetType() != framework::proto::VarType::LOD_TENSOR ||
+          writers.at(var.get()).size() != 1) {
+        return false;
+      }
+      for (auto &param2input : op.inputs_) {
+        for (auto &input : param2input.second) {
+          if (input == var) return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// Whether an op strictly between first and last writes an input of op
+bool InputsWritten(const OpHandle &op,
+                   size_t first,
+                   size_t last,
+                   const Writers &writers) {
+  for (auto &param2var : op.inputs_) {
+    for (auto &var : param2var.second) {
+      auto it = writers.find(var.get());
+      if (it == writers.end()) continue;
+      for (size_t w : it->second) {
+        if (w > first && w < last) return true;
+      }
+    }
+  }
+  return false;
+}
+
+// Read the outputs of the first op instead of those of an eliminated one
+void Substitute(
+    const std::unordered_map<const Variable *, VariableHandle> &substitutes,
+    OpHandle *op) {
+  size_t k = 0;
+  for (auto &param2var : op->inputs_) {
+    for (auto &var : param2var.second) {
+      auto it = substitutes.find(var.get());
+      if (it != substitutes.end()) {
+        var = it->second;
+        op->input_versions_[k] = var->Version();
+        // Resolved against the old arguments
+        op->cached_op_ = nullptr;
+        op->flat_vars_.clear();
+      }
+      ++k;
+    }
+  }
+}
+
+}  // namespace
+
+size_t EliminateCommonSubexpressions(OpHandleList *tape,
+                                     size_t begin,
+                                     size_t end) {
+  if (!FLAGS_tape_cse) return 0;
+
+  Writers writers;
+  for (size_t i = 0; i < tape->size(); ++i) {
+    for (auto &param2var : (*tape)[i].outputs_) {
+      for (auto &var : param2var.second) {
+        writers[var.get()].push_back(i);
+      }
+    }
+  }
+
+  std::unordered_map<std::string, std::vector<size_t>> firsts;
+  std::unordered_map<const Variable *, VariableHandle> substitutes;
+  size_t eliminated = 0;
+  for (size_t j = begin; j < end; ++j) {
+    OpHandle &op = (*tape)[j];
+    if (!substitutes.empty()) Substitute(substitutes, &op);
+    if (!Eligible(op, writers)) continue;
+
+    auto &same = firsts[Fingerprint(op)];
+    auto first = std::find_if(same.begin(), same.end(), [&](size_t i) {
+      return !InputsWritten(op, i, j, writers);
+    });
+    if (first == same.end()) {
+      same.push_back(j);
+      continue;
+    }
+
+    std::vector<VariableHandle> sources;
+    for (auto &param2var : (*tape)[*first].outputs_) {
+      for (auto &var : param2var.second) {
+        sources.push_back(var);
+      }
+    }
+    auto source = sources.begin();
+    for (auto &param2var : op.outputs_) {
+      for (auto &var : param2var.second) {
+        substitutes[var.get()] = *source++;
+      }
+    }
+    VLOG(3) << "Eliminating " << op.type_ << " #" << j << ", same as #"
+            << *first;
+
+    // The versions follow the order of the params
+    std::vector<uint64_t> recorded = std::move(op.input_versions_);
+    op.input_versions_.clear();
+    op.inputs_[kCseSource] = std::move(sources);
+    auto version = recorded.begin();
+    for (auto &param2var : op.inputs_) {
+      for (auto &var : param2var.second) {
+        op.input_versions_.push_back(
+            param2var.first == kCseSource ? var->Version() : *version++);
+      }
+    }
+    ++eliminated;
+  }
+  return eliminated;
+}
+
+void ShareSourceOutputs(OpHandle *op) {
+  auto source = op->inputs_.at(kCseSource).begin();
+  for (auto &param2var : op->outputs_) {
+    for (auto &var : param2var.second) {
+      const Variable &shared = **source++;
+      auto &data = shared.Var().Get<framework::LoDTensor>();
+      var->InitializeVariable();
+      auto *tensor = var->MutableVar()->GetMutable<framework::LoDTensor>();
+      tensor->ShareDataWith(data);
+      tensor->set_lod(data.lod());
+      var->SetSharesConstant(shared.SharesConstant());
+    }
+  }
+}
+
+VariableHandleMap RecordedInputs(const OpHandle &op) {
+  VariableHandleMap inputs;
+  for (auto &param2var : op.inputs_) {
+    if (param2var.first != kCseSource) {
+      inputs[param2var.first] = param2var.second;
+    }
+  }
+  return inputs;
+}
+
+}  // namespace tape
+}  // namespace paddle
@@ -0,0 +1,59 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <cstddef>
+
+#include "src/tape.h"
+
+namespace paddle {
+namespace tape {
+
+/*
+ * Common subexpression elimination, off unless FLAGS_tape_cse is set.
+ *
+ * An op is eliminated when an earlier op of the same range has the same
+ * type and attributes and reads the same Variables at the same versions,
+ * and nothing in between writes them. Both ops must be deterministic, must
+ * be the only writers of their outputs, and must not run in place.
+ *
+ * The later ops of the range read the outputs of the first op instead, so
+ * neither the eliminated op nor its grad op is run. The eliminated op stays
+ * on the tape for the Variables held outside of it: it reads the outputs of
+ * the first op through the kCseSource parameter and shares their data. So
+ * the outputs of an eliminated op must not be overwritten afterwards, and
+ * PlanInplace() never runs an op in place of them or of their sources.
+ */
+
+// Parameter of an eliminated op listing the outputs of the first op
+extern const char kCseSource[];
+
+// Eliminate the common subexpressions of tape[begin, end), return the
+// number of ops eliminated
+size_t EliminateCommonSubexpressions(OpHandleList *tape,
+                                     size_t begin,
+                                     size_t end);
+
+inline bool IsEliminated(const OpHandle &op) {
+  return op.inputs_.count(kCseSource) > 0;
+}
+
+// Run an eliminated op: its outputs share the data of the first op's
+void ShareSourceOutputs(OpHandle *op);
+
+// The arguments op was recorded with, without kCseSource
+VariableHandleMap RecordedInputs(const OpHandle &op);
+
+}  // namespace tape
+}  // namespace paddle
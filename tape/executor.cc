@@ -0,0 +1,171 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/executor.h"
+
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "paddle/fluid/platform/enforce.h"
+
+namespace paddle {
+namespace tape {
+
+ParallelExecutor::ParallelExecutor(const ExecutionStrategy &strategy)
+    : strategy_(strategy) {
+  PADDLE_ENFORCE_GT(strategy_.num_threads, 0UL);
+  for (size_t i = 0; i < strategy_.num_threads; ++i) {
+    workers_.emplace_back([this] { WorkerLoop(); });
+  }
+}
+
+ParallelExecutor::~ParallelExecutor() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  ready_cv_.notify_all();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+}
+
+void ParallelExecutor::Run(const std::vector<std::vector<size_t>> &deps,
+                           const std::function<void(size_t)> &run_op) {
+  if (deps.empty()) return;
+  for (size_t i = 0; i < deps.size(); ++i) {
+    for (size_t dep : deps[i]) {
+      PADDLE_ENFORCE_LT(dep, i, "Dependency %d of op %d is not before it",
+                        dep, i);
+    }
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  PADDLE_ENFORCE(run_op_ == nullptr, "ParallelExecutor::Run is not reentrant");
+  run_op_ = &run_op;
+  successors_.assign(deps.size(), {});
+  pending_deps_.assign(deps.size(), 0);
+  ready_.clear();
+  remaining_ = deps.size();
+  exception_ = nullptr;
+  for (size_t i = 0; i < deps.size(); ++i) {
+    for (size_t dep : deps[i]) {
+      successors_[dep].push_back(i);
+    }
+    pending_deps_[i] = deps[i].size();
+    if (pending_deps_[i] == 0) {
+      ready_.push_back(i);
+    }
+  }
+  ready_cv_.notify_all();
+
+  finished_cv_.wait(lock, [this] { return remaining_ == 0; });
+  run_op_ = nullptr;
+  if (exception_) {
+    std::rethrow_exception(exception_);
+  }
+}
+
+void ParallelExecutor::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    ready_cv_.wait(lock, [this] { return stop_ || !ready_.empty(); });
+    if (stop_) return;
+
+    size_t op = ready_.back();
+    ready_.pop_back();
+    if (!exception_) {
+      lock.unlock();
+      try {
+        (*run_op_)(op);
+      } catch (...) {
+        lock.lock();
+        if (!exception_) exception_ = std::current_exception();
+        lock.unlock();
+      }
+      lock.lock();
+    }
+
+    // After a failure the remaining ops are drained without running them
+    for (size_t next : successors_[op]) {
+      if (--pending_deps_[next] == 0) {
+        ready_.push_back(next);
+      }
+    }
+    if (--remaining_ == 0) {
+      finished_cv_.notify_all();
+    } else if (!ready_.empty()) {
+      ready_cv_.notify_all();
+    }
+  }
+}
+
+AsyncExecutor::AsyncExecutor() : worker_([this] { WorkerLoop(); }) {}
+
+AsyncExecutor::~AsyncExecutor() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  submitted_cv_.notify_all();
+  worker_.join();
+}
+
+size_t AsyncExecutor::Submit(std::function<void()> task) {
+  size_t number;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.push_back(std::move(task));
+    number = ++submitted_;
+  }
+  submitted_cv_.notify_all();
+  return number;
+}
+
+void AsyncExecutor::Wait(size_t task) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  PADDLE_ENFORCE_LE(task, submitted_, "Task %d has not been submitted", task);
+  finished_cv_.wait(lock, [this, task] { return finished_ >= task; });
+  if (exception_) {
+    std::rethrow_exception(exception_);
+  }
+}
+
+void AsyncExecutor::WorkerLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    submitted_cv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+    if (stop_) return;
+
+    std::function<void()> task = std::move(tasks_.front());
+    tasks_.pop_front();
+    if (!exception_) {
+      lock.unlock();
+      try {
+        task();
+      } catch (...) {
+        lock.lock();
+        exception_ = std::current_exception();
+        lock.unlock();
+      }
+      lock.lock();
+    }
+    ++finished_;
+    finished_cv_.notify_all();
+  }
+}
+
+}  // namespace tape
+}  // namespace paddle
@@ -0,0 +1,107 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <condition_variable>  // NOLINT
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>  // NOLINT
+#include <thread>  // NOLINT
+#include <vector>
+
+namespace paddle {
+namespace tape {
+
+struct ExecutionStrategy {
+  // Number of threads running independent ops, 1 runs the ops in order
+  size_t num_threads = 1;
+};
+
+/*
+ * Runs a DAG of ops on a pool of worker threads.
+ *
+ * Op i is started once all the ops listed in deps[i] have finished. Every
+ * dependency of op i must be less than i, which holds for a graph built
+ * from the order of a tape.
+ */
+class ParallelExecutor {
+ public:
+  explicit ParallelExecutor(const ExecutionStrategy &strategy);
+  ~ParallelExecutor();
+
+  const ExecutionStrategy &Strategy() const { return strategy_; }
+
+  // Blocks until all ops have run, rethrows the first exception of an op
+  void Run(const std::vector<std::vector<size_t>> &deps,
+           const std::function<void(size_t)> &run_op);
+
+ private:
+  void WorkerLoop();
+
+  ExecutionStrategy strategy_;
+  std::vector<std::thread> workers_;
+
+  std::mutex mutex_;
+  std::condition_variable ready_cv_;
+  std::condition_variable finished_cv_;
+  bool stop_ = false;
+
+  // State of the ongoing Run()
+  const std::function<void(size_t)> *run_op_ = nullptr;
+  std::vector<std::vector<size_t>> successors_;
+  std::vector<size_t> pending_deps_;
+  std::vector<size_t> ready_;
+  size_t remaining_ = 0;
+  std::exception_ptr exception_;
+};
+
+/*
+ * Runs tasks one after the other, in submission order, on a background
+ * thread.
+ *
+ * Tasks are numbered from 1 in submission order. Once a task has thrown,
+ * the following tasks are skipped and every Wait() rethrows the exception.
+ * Pending tasks are discarded on destruction.
+ */
+class AsyncExecutor {
+ public:
+  AsyncExecutor();
+  ~AsyncExecutor();
+
+  // Returns the number of the task
+  size_t Submit(std::function<void()> task);
+  // Blocks until task and all the tasks before it have finished
+  void Wait(size_t task);
+  void WaitAll() { Wait(submitted_); }
+
+ private:
+  void WorkerLoop();
+
+  std::mutex mutex_;
+  std::condition_variable submitted_cv_;
+  std::condition_variable finished_cv_;
+  bool stop_ = false;
+
+  std::deque<std::function<void()>> tasks_;
+  size_t submitted_ = 0;
+  size_t finished_ = 0;
+  std::exception_ptr exception_;
+
+  // Last, so that it starts once the members above are initialized
+  std::thread worker_;
+};
+
+}  // namespace tape
+}  // namespace paddle
@@ -0,0 +1,369 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/fusion.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>  // NOLINT
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "paddle/fluid/framework/op_info.h"
+#include "paddle/fluid/framework/operator.h"
+
+DEFINE_bool(tape_fuse_elementwise,
+            true,
+            "If set, Tape runs the bias add and activation of a Linear, and "
+            "their grads, as one fused kernel.");
+
+namespace paddle {
+namespace tape {
+
+constexpr size_t FusionPlan::kNotFused;
+
+namespace {
+
+enum class Activation { kNone, kRelu, kSigmoid, kTanh };
+
+Activation ActivationOf(const std::string &type) {
+  if (type == "relu" || type == "relu_grad") return Activation::kRelu;
+  if (type == "sigmoid" || type == "sigmoid_grad") return Activation::kSigmoid;
+  if (type == "tanh" || type == "tanh_grad") return Activation::kTanh;
+  return Activation::kNone;
+}
+
+bool IsActivationGrad(const std::string &type) {
+  return ActivationOf(type) != Activation::kNone &&
+         type.size() > 5 && type.compare(type.size() - 5, 5, "_grad") == 0;
+}
+
+inline float Activate(Activation act, float x) {
+  switch (act) {
+    case Activation::kRelu:
+      return x > 0 ? x : 0;
+    case Activation::kSigmoid:
+      return 1 / (1 + std::exp(-x));
+    case Activation::kTanh:
+      return std::tanh(x);
+    default:
+      return x;
+  }
+}
+
+// Derivative of the activation, computed from its output
+inline float ActivationGrad(Activation act, float out) {
+  switch (act) {
+    case Activation::kRelu:
+      return out > 0 ? 1 : 0;
+    case Activation::kSigmoid:
+      return out * (1 - out);
+    case Activation::kTanh:
+      return 1 - out * out;
+    default:
+      return 1;
+  }
+}
+
+// The only argument of param, nullptr if there is not exactly one
+VariableHandle Single(const VariableHandleMap &vars, const std::string &param) {
+  auto it = vars.find(param);
+  if (it == vars.end() || it->second.size() != 1) return nullptr;
+  return it->second[0];
+}
+
+const framework::LoDTensor &Tensor(const VariableHandle &var) {
+  return var->Var().Get<framework::LoDTensor>();
+}
+
+framework::LoDTensor *MutableTensor(const VariableHandle &var) {
+  var->InitializeVariable();
+  return var->MutableVar()->GetMutable<framework::LoDTensor>();
+}
+
+// Whether Y is a 1-D bias added to X along its last axis
+bool IsBiasAdd(const VariableHandle &x,
+               const VariableHandle &y,
+               const framework::AttributeMap &attrs) {
+  if (x == nullptr || y == nullptr) return false;
+  auto x_shape = x->Desc().GetShape();
+  auto y_shape = y->Desc().GetShape();
+  if (y_shape.size() != 1 || x_shape.empty() ||
+      x_shape.back() != y_shape[0]) {
+    return false;
+  }
+  auto axis = attrs.find("axis");
+  int rank = static_cast<int>(x_shape.size());
+  return axis == attrs.end() || boost::get<int>(axis->second) == -1 ||
+         boost::get<int>(axis->second) == rank - 1;
+}
+
+// The output of producer that consumer reads, if they form a fusable chain
+VariableHandle Intermediate(const OpHandle &producer,
+                            const OpHandle &consumer) {
+  if (producer.type_ == "elementwise_add" &&
+      ActivationOf(consumer.type_) != Activation::kNone &&
+      !IsActivationGrad(consumer.type_)) {
+    VariableHandle out = Single(producer.outputs_, "Out");
+    if (out == nullptr || Single(consumer.inputs_, "X") != out) return nullptr;
+    if (!IsBiasAdd(Single(producer.inputs_, "X"),
+                   Single(producer.inputs_, "Y"),
+                   producer.attrs_) ||
+        Single(consumer.outputs_, "Out") == nullptr) {
+      return nullptr;
+    }
+    return out;
+  }
+
+  if (IsActivationGrad(producer.type_) &&
+      consumer.type_ == "elementwise_add_grad") {
+    std::string x_grad = framework::GradVarName("X");
+    std::string out_grad = framework::GradVarName("Out");
+    VariableHandle dx = Single(producer.outputs_, x_grad);
+    if (dx == nullptr || Single(consumer.inputs_, out_grad) != dx) {
+      return nullptr;
+    }
+    if (Single(producer.inputs_, "Out") == nullptr ||
+        Single(producer.inputs_, out_grad) == nullptr ||
+        !IsBiasAdd(Single(consumer.inputs_, "X"),
+                   Single(consumer.inputs_, "Y"),
+                   consumer.attrs_)) {
+      return nullptr;
+    }
+    return dx;
+  }
+  return nullptr;
+}
+
+bool RunBiasActivation(OpHandle *add, OpHandle *act, bool elide) {
+  auto &x = Tensor(Single(add->inputs_, "X"));
+  auto &y = Tensor(Single(add->inputs_, "Y"));
+  if (x.type() != typeid(float) || y.type() != typeid(float)) return false;
+  int64_t width = y.numel();
+  if (width == 0 || x.numel() % width != 0) return false;
+
+  float *pre_act = nullptr;
+  if (!elide) {
+    auto *tensor = MutableTensor(Single(add->outputs_, "Out"));
+    tensor->Resize(x.dims());
+    tensor->set_lod(x.lod());
+    pre_act = tensor->mutable_data<float>(platform::CPUPlace());
+  }
+  auto *out = MutableTensor(Single(act->outputs_, "Out"));
+  out->Resize(x.dims());
+  out->set_lod(x.lod());
+  float *post_act = out->mutable_data<float>(platform::CPUPlace());
+
+  Activation activation = ActivationOf(act->type_);
+  const float *px = x.data<float>();
+  const float *py = y.data<float>();
+  int64_t height = x.numel() / width;
+  for (int64_t i = 0; i < height; ++i) {
+    for (int64_t j = 0; j < width; ++j) {
+      float v = px[i * width + j] + py[j];
+      if (pre_act) pre_act[i * width + j] = v;
+      post_act[i * width + j] = Activate(activation, v);
+    }
+  }
+  return true;
+}
+
+bool RunActivationBiasGrad(OpHandle *act_grad, OpHandle *add_grad, bool elide) {
+  std::string out_grad = framework::GradVarName("Out");
+  auto &out = Tensor(Single(act_grad->inputs_, "Out"));
+  auto &dout = Tensor(Single(act_grad->inputs_, out_grad));
+  auto &y = Tensor(Single(add_grad->inputs_, "Y"));
+  if (out.type() != typeid(float) || dout.type() != typeid(float)) {
+    return false;
+  }
+  int64_t width = y.numel();
+  if (width == 0 || dout.numel() % width != 0 ||
+      out.numel() != dout.numel()) {
+    return false;
+  }
+
+  auto output = [&dout](OpHandle *op, const std::string &param) -> float * {
+    VariableHandle var = Single(op->outputs_, param);
+    if (var == nullptr) return nullptr;
+    auto *tensor = MutableTensor(var);
+    tensor->Resize(dout.dims());
+    tensor->set_lod(dout.lod());
+    return tensor->mutable_data<float>(platform::CPUPlace());
+  };
+  float *pre_act_grad =
+      elide ? nullptr : output(act_grad, framework::GradVarName("X"));
+  float *x_grad = output(add_grad, framework::GradVarName("X"));
+  float *y_grad = nullptr;
+  VariableHandle y_grad_var = Single(add_grad->outputs_,
+                                     framework::GradVarName("Y"));
+  if (y_grad_var != nullptr) {
+    auto *tensor = MutableTensor(y_grad_var);
+    tensor->Resize(y.dims());
+    y_grad = tensor->mutable_data<float>(platform::CPUPlace());
+    std::fill(y_grad, y_grad + width, 0.0f);
+  }
+
+  Activation activation = ActivationOf(act_grad->type_);
+  const float *po = out.data<float>();
+  const float *pdo = dout.data<float>();
+  int64_t height = dout.numel() / width;
+  for (int64_t i = 0; i < height; ++i) {
+    for (int64_t j = 0; j < width; ++j) {
+      int64_t k = i * width + j;
+      float g = pdo[k] * ActivationGrad(activation, po[k]);
+      if (pre_act_grad) pre_act_grad[k] = g;
+      if (x_grad) x_grad[k] = g;
+      if (y_grad) y_grad[j] += g;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+bool GradReads(const OpHandle &op, const std::string &param) {
+  static std::mutex mutex;
+  static std::unordered_map<std::string, bool> cache;
+
+  std::string key = op.type_ + "|" + param;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = cache.find(key);
+  if (it != cache.end()) return it->second;
+
+  bool reads = false;
+  auto &info = framework::OpInfoMap::Instance().Get(op.type_);
+  if (info.grad_op_maker_ != nullptr) {
+    framework::OpDesc op_desc =
+        CreateOpDesc(op.type_, op.inputs_, op.outputs_, op.attrs_);
+    std::unordered_map<std::string, std::string> grad_to_var;
+    auto grad_op_descs = info.grad_op_maker_(op_desc, {}, &grad_to_var, {});
+    std::string name = op_desc.Input(param).empty()
+                           ? op_desc.Output(param).at(0)
+                           : op_desc.Input(param).at(0);
+    for (auto &grad_op_desc : grad_op_descs) {
+      for (auto &argu : grad_op_desc->InputArgumentNames()) {
+        reads = reads || argu == name;
+      }
+    }
+  }
+  cache[key] = reads;
+  return reads;
+}
+
+FusionPlan PlanFusion(const OpHandleList &tape,
+                      size_t begin,
+                      size_t end) {
+  FusionPlan plan(end - begin);
+  if (!FLAGS_tape_fuse_elementwise) return plan;
+
+  // Readers, writers and references held by the tape for every Variable,
+  // modifiers are the writers plus the ops releasing it
+  std::unordered_map<Variable *, std::vector<size_t>> readers;
+  std::unordered_map<Variable *, std::vector<size_t>> writers;
+  std::unordered_map<Variable *, std::vector<size_t>> modifiers;
+  std::unordered_map<Variable *, int64_t> tape_refs;
+  for (size_t i = 0; i < tape.size(); ++i) {
+    for (auto &param2var : tape[i].inputs_) {
+      for (auto &var : param2var.second) {
+        readers[var.get()].push_back(i);
+        tape_refs[var.get()]++;
+      }
+    }
+    for (auto &param2var : tape[i].outputs_) {
+      for (auto &var : param2var.second) {
+        writers[var.get()].push_back(i);
+        modifiers[var.get()].push_back(i);
+        tape_refs[var.get()]++;
+      }
+    }
+    for (auto *var : tape[i].release_after_run_) {
+      modifiers[var].push_back(i);
+    }
+  }
+
+  for (size_t p = begin; p < end; ++p) {
+    if (plan.skip[p - begin] ||
+        plan.producer[p - begin] != FusionPlan::kNotFused) {
+      continue;
+    }
+    const OpHandle &producer = tape[p];
+    VariableHandle out;
+    for (auto &param2var : producer.outputs_) {
+      for (auto &var : param2var.second) {
+        out = var;
+      }
+    }
+    if (out == nullptr) continue;
+
+    auto &out_readers = readers[out.get()];
+    auto &out_writers = writers[out.get()];
+    if (out_readers.size() != 1 || out_writers.size() != 1) continue;
+    size_t c = out_readers[0];
+    if (c <= p || c >= end ||
+        plan.producer[c - begin] != FusionPlan::kNotFused) {
+      continue;
+    }
+    const OpHandle &consumer = tape[c];
+    if (Intermediate(producer, consumer) != out) continue;
+
+    // The producer runs at the consumer's turn, so no op in between may
+    // overwrite or release what the producer reads
+    bool clobbered = false;
+    for (auto &param2var : producer.inputs_) {
+      for (auto &var : param2var.second) {
+        for (size_t m : modifiers[var.get()]) {
+          clobbered = clobbered || (m > p && m < c);
+        }
+      }
+    }
+    // and the producer's releases, now deferred, must not drop a new value
+    for (auto *var : producer.release_after_run_) {
+      for (size_t w : writers[var]) {
+        clobbered = clobbered || (w > p && w < c);
+      }
+    }
+    if (clobbered) continue;
+
+    // out is not held outside of the tape, besides the local handle, and no
+    // grad op will read it
+    bool elide = out.use_count() - 1 == tape_refs[out.get()];
+    for (auto *op : {&producer, &consumer}) {
+      for (auto *vars : {&op->inputs_, &op->outputs_}) {
+        for (auto &param2var : *vars) {
+          for (auto &var : param2var.second) {
+            if (var == out) elide = elide && !GradReads(*op, param2var.first);
+          }
+        }
+      }
+    }
+
+    plan.producer[c - begin] = p - begin;
+    plan.skip[p - begin] = true;
+    plan.elide[c - begin] = elide;
+  }
+  return plan;
+}
+
+bool RunFused(OpHandle *producer, OpHandle *consumer, bool elide) {
+  if (producer->type_ == "elementwise_add") {
+    return RunBiasActivation(producer, consumer, elide);
+  }
+  return RunActivationBiasGrad(producer, consumer, elide);
+}
+
+}  // namespace tape
+}  // namespace paddle
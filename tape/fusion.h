@@ -0,0 +1,65 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "src/tape.h"
+
+namespace paddle {
+namespace tape {
+
+/*
+ * Elementwise fusion of a chain of two ops, a producer and the only op that
+ * consumes its output.
+ *
+ * Supported chains are the bias epilogue of Linear
+ *     elementwise_add -> relu / sigmoid / tanh
+ * and its backward
+ *     relu_grad / sigmoid_grad / tanh_grad -> elementwise_add_grad
+ *
+ * The fused kernel runs in one pass over the data when the consumer's turn
+ * comes, and the producer is skipped. The intermediate is not materialized
+ * unless a grad op will read it.
+ */
+struct FusionPlan {
+  static constexpr size_t kNotFused = static_cast<size_t>(-1);
+
+  explicit FusionPlan(size_t size)
+      : producer(size, kNotFused), skip(size, false), elide(size, false) {}
+
+  // producer[i] is the op fused into op i, or kNotFused
+  std::vector<size_t> producer;
+  // Op i is run by its consumer
+  std::vector<bool> skip;
+  // The intermediate of the chain ending at op i need not be written
+  std::vector<bool> elide;
+};
+
+// Plan the fusion of tape[begin, end), all positions are relative to begin
+FusionPlan PlanFusion(const OpHandleList &tape,
+                      size_t begin,
+                      size_t end);
+
+// Whether a grad op of op reads the argument of its parameter param. The
+// answer only depends on the op type and is cached.
+bool GradReads(const OpHandle &op, const std::string &param);
+
+// Run a planned chain with a fused kernel. Returns false, without touching
+// any Variable, if the kernel does not support the data of the chain.
+bool RunFused(OpHandle *producer, OpHandle *consumer, bool elide);
+
+}  // namespace tape
+}  // namespace paddle
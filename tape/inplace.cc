@@ -0,0 +1,153 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/inplace.h"
+
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "src/cse.h"
+
+DEFINE_bool(tape_inplace,
+            true,
+            "If set, Tape::Forward runs elementwise ops in place of an input "
+            "that nothing else uses.");
+
+namespace paddle {
+namespace tape {
+
+namespace {
+
+// Elementwise ops whose kernels are safe with Out aliasing X
+const std::unordered_set<std::string> &InplaceOps() {
+  static const std::unordered_set<std::string> ops = {"relu",
+                                                      "sigmoid",
+                                                      "tanh",
+                                                      "scale",
+                                                      "elementwise_add",
+                                                      "elementwise_sub",
+                                                      "elementwise_mul"};
+  return ops;
+}
+
+// The only argument of param, nullptr if there is not exactly one
+Variable *Single(const VariableHandleMap &vars, const std::string &param) {
+  auto it = vars.find(param);
+  if (it == vars.end() || it->second.size() != 1) return nullptr;
+  return it->second[0].get();
+}
+
+// The parameter of op that has var as an argument
+std::string ParamOf(const VariableHandleMap &vars, const Variable *var) {
+  for (auto &param2var : vars) {
+    for (auto &v : param2var.second) {
+      if (v.get() == var) return param2var.first;
+    }
+  }
+  return "";
+}
+
+}  // namespace
+
+InplacePlan PlanInplace(const OpHandleList &tape,
+                        size_t begin,
+                        size_t end,
+                        const FusionPlan &fusion) {
+  InplacePlan plan(end - begin);
+  if (!FLAGS_tape_inplace) return plan;
+
+  // Ops of the tape referencing every Variable, and references held by them
+  std::unordered_map<const Variable *, std::vector<size_t>> users;
+  std::unordered_map<const Variable *, std::vector<size_t>> writers;
+  std::unordered_map<const Variable *, int64_t> tape_refs;
+  for (size_t i = 0; i < tape.size(); ++i) {
+    for (auto &param2var : tape[i].inputs_) {
+      for (auto &var : param2var.second) {
+        users[var.get()].push_back(i);
+        tape_refs[var.get()]++;
+      }
+    }
+    for (auto &param2var : tape[i].outputs_) {
+      for (auto &var : param2var.second) {
+        users[var.get()].push_back(i);
+        writers[var.get()].push_back(i);
+        tape_refs[var.get()]++;
+      }
+    }
+    for (auto *var : tape[i].release_after_run_) {
+      users[var].push_back(i);
+    }
+  }
+  // The outputs of an eliminated op share the data of these, possibly
+  // across ranges
+  std::unordered_set<const Variable *> cse_sources;
+  for (auto &op : tape) {
+    if (!IsEliminated(op)) continue;
+    for (auto &var : op.inputs_.at(kCseSource)) {
+      cse_sources.insert(var.get());
+    }
+  }
+
+  for (size_t i = begin; i < end; ++i) {
+    const OpHandle &op = tape[i];
+    if (fusion.skip[i - begin] ||
+        fusion.producer[i - begin] != FusionPlan::kNotFused ||
+        !InplaceOps().count(op.type_)) {
+      continue;
+    }
+    Variable *x = Single(op.inputs_, "X");
+    Variable *out = Single(op.outputs_, "Out");
+    if (x == nullptr || out == nullptr || x == out) continue;
+
+    // x is written by one earlier op and used by this op only once
+    auto &x_writers = writers[x];
+    auto &x_users = users[x];
+    if (x_writers.size() != 1 || x_writers[0] >= i || x_users.size() != 2 ||
+        x_users[1] != i) {
+      continue;
+    }
+    // out is not used before this op, which is its only writer
+    if (writers[out].size() != 1 || users[out][0] != i) continue;
+
+    const OpHandle &producer = tape[x_writers[0]];
+    if (IsEliminated(producer) || cse_sources.count(x)) continue;
+    std::string x_param = ParamOf(producer.outputs_, x);
+    bool held_outside = true;
+    for (auto &var : producer.outputs_.at(x_param)) {
+      if (var.get() == x) held_outside = var.use_count() != tape_refs[x];
+    }
+    if (held_outside || GradReads(op, "X") || GradReads(producer, x_param)) {
+      continue;
+    }
+
+    auto &x_desc = x->Desc();
+    auto &out_desc = out->Desc();
+    if (x_desc.GetType() != framework::proto::VarType::LOD_TENSOR ||
+        out_desc.GetType() != framework::proto::VarType::LOD_TENSOR ||
+        x_desc.GetShape() != out_desc.GetShape() ||
+        x_desc.GetDataType() != out_desc.GetDataType()) {
+      continue;
+    }
+
+    plan.input[i - begin] = x;
+    plan.output[i - begin] = out;
+  }
+  return plan;
+}
+
+}  // namespace tape
+}  // namespace paddle
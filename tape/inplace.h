@@ -0,0 +1,54 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <vector>
+
+#include "src/fusion.h"
+#include "src/tape.h"
+
+namespace paddle {
+namespace tape {
+
+/*
+ * In-place execution of elementwise ops.
+ *
+ * The Out of an elementwise op reuses the storage of its input X when X
+ *   - is an intermediate written by a single earlier op of the tape, and
+ *     read by this op only,
+ *   - is not held outside of the tape,
+ *   - is not read by the grad op of either op,
+ *   - and has the shape and data type of Out.
+ *
+ * Running the op in place bumps the version of X, so that an op that
+ * would still read X is caught.
+ */
+struct InplacePlan {
+  explicit InplacePlan(size_t size) : input(size, nullptr), output(size) {}
+
+  // input[i] is the Variable whose storage output[i] of op i reuses, or
+  // nullptr if op i is not run in place
+  std::vector<Variable *> input;
+  std::vector<Variable *> output;
+};
+
+// Plan the in-place ops of tape[begin, end) that are not fused by fusion,
+// positions are relative to begin
+InplacePlan PlanInplace(const OpHandleList &tape,
+                        size_t begin,
+                        size_t end,
+                        const FusionPlan &fusion);
+
+}  // namespace tape
+}  // namespace paddle
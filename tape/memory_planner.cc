@@ -0,0 +1,293 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/memory_planner.h"
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "paddle/fluid/framework/data_type.h"
+#include "paddle/fluid/framework/tensor_util.h"
+#include "src/cse.h"
+#include "src/fusion.h"
+
+DEFINE_bool(tape_plan_memory,
+            true,
+            "If set, Tape::Freeze places the intermediates of the tape in "
+            "preallocated arenas.");
+
+namespace paddle {
+namespace tape {
+
+namespace {
+
+// Offsets are multiples of kAlignment bytes
+constexpr int64_t kAlignment = 64;
+
+struct Lifetime {
+  size_t first;
+  size_t last;
+  bool written;
+};
+
+struct Block {
+  Variable *var;
+  size_t arena;
+  int64_t size;
+  size_t first;
+  size_t last;
+  int64_t offset;
+  framework::DDim dims;
+};
+
+}  // namespace
+
+void MemoryPlan::Bind() {
+  // Values computed before, which the ops not run yet may read
+  std::vector<framework::LoDTensor> values(bindings.size());
+  for (size_t i = 0; i < bindings.size(); ++i) {
+    auto &var = bindings[i].var->Var();
+    if (var.IsInitialized() && var.IsType<framework::LoDTensor>()) {
+      values[i] = var.Get<framework::LoDTensor>();
+    }
+  }
+
+  for (size_t i = 0; i < bindings.size(); ++i) {
+    auto &binding = bindings[i];
+    binding.var->InitializeVariable();
+    auto *tensor =
+        binding.var->MutableVar()->GetMutable<framework::LoDTensor>();
+    int64_t end = binding.offset + framework::product(binding.dims);
+    tensor->ShareDataWith(arenas[binding.arena].Slice(
+        static_cast<int>(binding.offset), static_cast<int>(end)));
+    tensor->Resize(binding.dims);
+    binding.var->SetSharesConstant(false);
+
+    // Bindings are in the order their Variables are first written, so of
+    // two sharing a range the one still alive is copied last
+    auto &value = values[i];
+    if (value.IsInitialized() && value.dims() == binding.dims &&
+        value.type() == arenas[binding.arena].type()) {
+      framework::TensorCopySync(value, platform::CPUPlace(), tensor);
+      tensor->set_lod(value.lod());
+    }
+  }
+}
+
+size_t MemoryPlan::Bytes() const {
+  size_t bytes = 0;
+  for (auto &arena : arenas) {
+    bytes += arena.numel() * framework::SizeOfType(arena.type());
+  }
+  return bytes;
+}
+
+MemoryPlan PlanMemory(OpHandleList *forward, OpHandleList *backward) {
+  // Ops on the timeline and the positions at which each of them may run:
+  // a fused producer runs at the turn of its consumer
+  std::vector<OpHandle *> ops;
+  std::vector<std::pair<size_t, size_t>> spans;
+  for (auto *tape : {forward, backward}) {
+    if (tape == nullptr) continue;
+    size_t begin = ops.size();
+    FusionPlan fusion = PlanFusion(*tape, 0, tape->size());
+    for (auto &op : *tape) {
+      spans.emplace_back(ops.size(), ops.size());
+      ops.push_back(&op);
+    }
+    for (size_t i = 0; i < tape->size(); ++i) {
+      size_t producer = fusion.producer[i];
+      if (producer == FusionPlan::kNotFused) continue;
+      spans[begin + producer].second = begin + i;
+      spans[begin + i].first = begin + producer;
+    }
+  }
+
+  std::unordered_map<Variable *, Lifetime> lifetimes;
+  std::unordered_map<Variable *, int64_t> tape_refs;
+  // One of the handles of every Variable held by the tapes
+  std::unordered_map<Variable *, const VariableHandle *> handles;
+  auto use = [&](Variable *var, size_t i) {
+    auto it = lifetimes.find(var);
+    if (it == lifetimes.end()) {
+      lifetimes.emplace(var,
+                        Lifetime{spans[i].first, spans[i].second, false});
+    } else {
+      it->second.first = std::min(it->second.first, spans[i].first);
+      it->second.last = std::max(it->second.last, spans[i].second);
+    }
+  };
+  for (size_t i = 0; i < ops.size(); ++i) {
+    for (auto &param2var : ops[i]->inputs_) {
+      for (auto &var : param2var.second) {
+        use(var.get(), i);
+        tape_refs[var.get()]++;
+        handles[var.get()] = &var;
+      }
+    }
+    for (auto &param2var : ops[i]->outputs_) {
+      for (auto &var : param2var.second) {
+        use(var.get(), i);
+        lifetimes[var.get()].written = true;
+        tape_refs[var.get()]++;
+        handles[var.get()] = &var;
+      }
+    }
+    for (auto *var : ops[i]->release_after_run_) {
+      use(var, i);
+    }
+  }
+
+  // Variables that can be reached from outside of the tapes, either
+  // directly or through Variable::Grad()
+  std::unordered_set<Variable *> exposed;
+  for (auto &var2handle : handles) {
+    Variable *var = var2handle.first;
+    if (lifetimes[var].written &&
+        var2handle.second->use_count() == tape_refs[var]) {
+      continue;
+    }
+    exposed.insert(var);
+    VariableHandle grad = var->ExistingGrad();
+    if (grad != nullptr) {
+      exposed.insert(grad.get());
+    }
+  }
+
+  // The outputs of an eliminated op share the data of their sources, which
+  // may then be read for as long as the outputs are
+  for (auto *op : ops) {
+    if (!IsEliminated(*op)) continue;
+    for (auto &var : op->inputs_.at(kCseSource)) {
+      exposed.insert(var.get());
+    }
+    for (auto &param2var : op->outputs_) {
+      for (auto &var : param2var.second) {
+        exposed.insert(var.get());
+      }
+    }
+  }
+
+  MemoryPlan plan;
+  std::map<framework::proto::VarType::Type, size_t> arena_of_type;
+  std::vector<framework::proto::VarType::Type> arena_types;
+  std::vector<Block> blocks;
+  for (auto &var2lifetime : lifetimes) {
+    Variable *var = var2lifetime.first;
+    auto &desc = var->Desc();
+    if (!var2lifetime.second.written || exposed.count(var) ||
+        desc.GetType() != framework::proto::VarType::LOD_TENSOR) {
+      continue;
+    }
+    auto shape = desc.GetShape();
+    if (std::any_of(shape.begin(), shape.end(), [](int64_t d) {
+          return d <= 0;
+        })) {
+      continue;
+    }
+
+    auto type = desc.GetDataType();
+    auto inserted = arena_of_type.emplace(type, arena_types.size());
+    if (inserted.second) arena_types.push_back(type);
+    int64_t numel = framework::product(framework::make_ddim(shape));
+    int64_t align = std::max<int64_t>(
+        1, kAlignment / framework::SizeOfType(framework::ToTypeIndex(type)));
+    blocks.push_back(Block{var,
+                           inserted.first->second,
+                           (numel + align - 1) / align * align,
+                           var2lifetime.second.first,
+                           var2lifetime.second.last,
+                           0,
+                           framework::make_ddim(shape)});
+  }
+
+  // Largest first, each at the lowest offset free during its lifetime
+  std::vector<size_t> order(blocks.size());
+  for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+  std::sort(order.begin(), order.end(), [&blocks](size_t a, size_t b) {
+    return blocks[a].size != blocks[b].size ? blocks[a].size > blocks[b].size
+                                            : blocks[a].first < blocks[b].first;
+  });
+  std::vector<int64_t> arena_sizes(arena_types.size(), 0);
+  for (size_t n = 0; n < order.size(); ++n) {
+    Block &block = blocks[order[n]];
+    std::vector<std::pair<int64_t, int64_t>> taken;
+    for (size_t m = 0; m < n; ++m) {
+      const Block &placed = blocks[order[m]];
+      if (placed.arena == block.arena && placed.first <= block.last &&
+          block.first <= placed.last) {
+        taken.emplace_back(placed.offset, placed.offset + placed.size);
+      }
+    }
+    std::sort(taken.begin(), taken.end());
+
+    int64_t offset = 0;
+    for (auto &range : taken) {
+      if (range.first - offset >= block.size) break;
+      offset = std::max(offset, range.second);
+    }
+    block.offset = offset;
+    arena_sizes[block.arena] =
+        std::max(arena_sizes[block.arena], offset + block.size);
+  }
+  for (int64_t size : arena_sizes) {
+    // Bind() slices the arenas at int offsets
+    PADDLE_ENFORCE_LE(size,
+                      static_cast<int64_t>(std::numeric_limits<int>::max()),
+                      "An arena of %d elements is too large to plan",
+                      size);
+  }
+
+  std::sort(order.begin(), order.end(), [&blocks](size_t a, size_t b) {
+    return blocks[a].first < blocks[b].first;
+  });
+  for (size_t i : order) {
+    const Block &block = blocks[i];
+    plan.bindings.push_back(MemoryPlan::Binding{
+        block.var, block.arena, block.offset, block.dims});
+  }
+
+  plan.arenas.resize(arena_types.size());
+  for (size_t i = 0; i < arena_types.size(); ++i) {
+    plan.arenas[i].Resize(framework::make_ddim({arena_sizes[i]}));
+    plan.arenas[i].mutable_data(platform::CPUPlace(),
+                                framework::ToTypeIndex(arena_types[i]));
+  }
+
+  std::unordered_set<Variable *> planned;
+  for (auto &block : blocks) {
+    planned.insert(block.var);
+  }
+  for (auto *op : ops) {
+    auto &releases = op->release_after_run_;
+    releases.erase(std::remove_if(releases.begin(),
+                                  releases.end(),
+                                  [&planned](Variable *var) {
+                                    return planned.count(var) > 0;
+                                  }),
+                   releases.end());
+  }
+  VLOG(3) << "Planned " << blocks.size() << " Variables in " << plan.Bytes()
+          << " bytes";
+  return plan;
+}
+
+}  // namespace tape
+}  // namespace paddle
@@ -0,0 +1,65 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "paddle/fluid/framework/lod_tensor.h"
+#include "src/tape.h"
+
+namespace paddle {
+namespace tape {
+
+/*
+ * Static memory plan of the intermediates of a frozen tape.
+ *
+ * The ops of the forward tape followed by those of its backward tape form
+ * one timeline. Every intermediate LoDTensor with a static shape lives from
+ * the first to the last op using it, and is given an offset in the arena
+ * of its data type so that tensors alive at the same time do not overlap.
+ * Offsets are assigned greedily, largest tensor first, at the lowest gap
+ * that fits.
+ *
+ * Bind() makes every planned Variable a view of its range of the arena, so
+ * kernels write into the arena instead of allocating. Values already
+ * computed are copied into the arena, the ops not run yet still read them.
+ */
+struct MemoryPlan {
+  struct Binding {
+    Variable *var;
+    size_t arena;
+    int64_t offset;
+    framework::DDim dims;
+  };
+
+  void Bind();
+  // Size of all the arenas
+  size_t Bytes() const;
+
+  // One per data type
+  std::vector<framework::LoDTensor> arenas;
+  std::vector<Binding> bindings;
+};
+
+// Plan the intermediates of forward and backward, which may be nullptr. The
+// planned Variables are removed from the release lists of the ops, they live
+// in the arena.
+//
+// A Variable is planned if it is written by an op of the tapes, is not held
+// outside of them, and is not the gradient of a Variable that is.
+MemoryPlan PlanMemory(OpHandleList *forward, OpHandleList *backward);
+
+}  // namespace tape
+}  // namespace paddle
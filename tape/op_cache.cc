@@ -0,0 +1,300 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/op_cache.h"
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "paddle/fluid/framework/op_registry.h"
+
+DEFINE_bool(tape_cache_operators,
+            true,
+            "If set, Tape::Forward reuses the constructed OperatorBase of "
+            "ops with the same type, attributes and argument layout.");
+DEFINE_int32(tape_infer_shape_cache_capacity,
+             4096,
+             "Number of distinct ops whose inferred output VarDescs are "
+             "cached.");
+
+namespace paddle {
+namespace tape {
+
+namespace {
+
+class AttributeFingerprintVisitor : public boost::static_visitor<void> {
+ public:
+  explicit AttributeFingerprintVisitor(std::ostream *os) : os_(os) {}
+
+  void operator()(const boost::blank &) const {}
+
+  void operator()(const std::string &v) const {
+    *os_ << v.size() << ":" << v;
+  }
+
+  template <typename T>
+  void operator()(const T &v) const {
+    *os_ << v;
+  }
+
+  template <typename T>
+  void operator()(const std::vector<T> &v) const {
+    *os_ << "[";
+    for (size_t i = 0; i < v.size(); ++i) {
+      (*this)(static_cast<T>(v[i]));
+      *os_ << ",";
+    }
+    *os_ << "]";
+  }
+
+ private:
+  std::ostream *os_;
+};
+
+std::string CacheKey(const std::string &type,
+                     const VariableHandleMap &in_vars,
+                     const VariableHandleMap &out_vars,
+                     const framework::AttributeMap &attrs) {
+  std::stringstream ss;
+  ss << type << "|";
+  for (auto &param2var : in_vars) {
+    ss << param2var.first << "#" << param2var.second.size() << ";";
+  }
+  ss << "|";
+  for (auto &param2var : out_vars) {
+    ss << param2var.first << "#" << param2var.second.size() << ";";
+  }
+  ss << "|" << AttributeFingerprint(attrs);
+  return ss.str();
+}
+
+}  // namespace
+
+void AppendDescFingerprint(const framework::VarDesc &desc, std::string *key) {
+  auto type = desc.GetType();
+  key->append("{").append(std::to_string(type));
+  if (type == framework::proto::VarType::LOD_TENSOR ||
+      type == framework::proto::VarType::SELECTED_ROWS ||
+      type == framework::proto::VarType::LOD_TENSOR_ARRAY) {
+    key->append(":").append(std::to_string(desc.GetDataType())).append(":");
+    for (int64_t d : desc.GetShape()) {
+      key->append(std::to_string(d)).append(",");
+    }
+  }
+  if (type == framework::proto::VarType::LOD_TENSOR ||
+      type == framework::proto::VarType::LOD_TENSOR_ARRAY) {
+    key->append(":").append(std::to_string(desc.GetLoDLevel()));
+  }
+  key->append(desc.Persistable() ? "p}" : "}");
+}
+
+std::string AttributeFingerprint(const framework::AttributeMap &attrs) {
+  std::vector<std::string> names;
+  names.reserve(attrs.size());
+  for (auto &pair : attrs) {
+    names.push_back(pair.first);
+  }
+  std::sort(names.begin(), names.end());
+
+  std::stringstream ss;
+  ss.precision(std::numeric_limits<double>::max_digits10);
+  AttributeFingerprintVisitor visitor(&ss);
+  for (auto &name : names) {
+    auto &attr = attrs.at(name);
+    ss << name << "=" << attr.which() << ":";
+    boost::apply_visitor(visitor, attr);
+    ss << ";";
+  }
+  return ss.str();
+}
+
+SlotScope::SlotScope(const std::vector<std::string> &names) {
+  slots_.reserve(names.size());
+  for (auto &name : names) {
+    PADDLE_ENFORCE(!vars_.count(name), "Duplicated slot %s", name);
+    // pointers to the elements of an unordered_map survive rehashing
+    slots_.push_back(&vars_[name]);
+  }
+}
+
+SlotScope::~SlotScope() { Unbind(); }
+
+void SlotScope::Bind(const std::vector<framework::Variable *> &vars) {
+  PADDLE_ENFORCE_EQ(slots_.size(), vars.size());
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    slots_[i]->release();
+    slots_[i]->reset(vars[i]);
+  }
+}
+
+void SlotScope::Unbind() {
+  for (auto *slot : slots_) {
+    slot->release();
+  }
+}
+
+CachedOperator::CachedOperator(const std::string &type,
+                               const VariableHandleMap &in_vars,
+                               const VariableHandleMap &out_vars,
+                               const framework::AttributeMap &attrs) {
+  framework::VariableNameMap inputs;
+  for (auto &param2var : in_vars) {
+    auto &names = inputs[param2var.first];
+    for (size_t i = 0; i < param2var.second.size(); ++i) {
+      names.emplace_back(param2var.first + "@IN" + std::to_string(i));
+      argument_names_.push_back(names.back());
+    }
+  }
+  framework::VariableNameMap outputs;
+  for (auto &param2var : out_vars) {
+    auto &names = outputs[param2var.first];
+    for (size_t i = 0; i < param2var.second.size(); ++i) {
+      names.emplace_back(param2var.first + "@OUT" + std::to_string(i));
+      argument_names_.push_back(names.back());
+    }
+  }
+  op_ = framework::OpRegistry::CreateOp(type, inputs, outputs, attrs);
+}
+
+void CachedOperator::Run(const std::vector<framework::Variable *> &vars,
+                         const platform::Place &place) {
+  std::unique_ptr<SlotScope> scope;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!scopes_.empty()) {
+      scope = std::move(scopes_.back());
+      scopes_.pop_back();
+    }
+  }
+  if (scope == nullptr) {
+    scope.reset(new SlotScope(argument_names_));
+  }
+
+  scope->Bind(vars);
+  op_->Run(*scope, place);
+  scope->Unbind();
+  scope->DropKids();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  scopes_.push_back(std::move(scope));
+}
+
+OperatorCache &OperatorCache::Instance() {
+  static OperatorCache cache;
+  return cache;
+}
+
+CachedOperator *OperatorCache::Get(const std::string &type,
+                                   const VariableHandleMap &in_vars,
+                                   const VariableHandleMap &out_vars,
+                                   const framework::AttributeMap &attrs) {
+  std::string key = CacheKey(type, in_vars, out_vars, attrs);
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto &op = ops_[key];
+  if (op == nullptr) {
+    VLOG(3) << "Caching operator " << key;
+    op.reset(new CachedOperator(type, in_vars, out_vars, attrs));
+  }
+  return op.get();
+}
+
+size_t OperatorCache::Size() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return ops_.size();
+}
+
+InferShapeCache &InferShapeCache::Instance() {
+  static InferShapeCache cache;
+  return cache;
+}
+
+std::string InferShapeCache::Key(const std::string &type,
+                                 const VariableHandleMap &in_vars,
+                                 const VariableHandleMap &out_vars,
+                                 const framework::AttributeMap &attrs) {
+  std::string key = type;
+  key.append("|").append(AttributeFingerprint(attrs));
+  for (auto *vars : {&in_vars, &out_vars}) {
+    key.append("|");
+    for (auto &param_name : *vars) {
+      key.append(param_name.first)
+          .append("#")
+          .append(std::to_string(param_name.second.size()))
+          .append(";");
+      for (auto &var : param_name.second) {
+        AppendDescFingerprint(var->Desc(), &key);
+      }
+    }
+  }
+  return key;
+}
+
+bool InferShapeCache::Lookup(const std::string &key,
+                             VariableHandleMap *out_vars) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto *cached = descs_.Find(key);
+  if (cached == nullptr) return false;
+  auto desc = cached->begin();
+  for (auto &param_name : *out_vars) {
+    for (auto &var : param_name.second) {
+      std::string name = var->Name();
+      *var->MutableDesc()->Proto() = *desc++;
+      var->MutableDesc()->Proto()->set_name(name);
+    }
+  }
+  return true;
+}
+
+void InferShapeCache::Insert(const std::string &key,
+                             const VariableHandleMap &out_vars) {
+  std::vector<framework::proto::VarDesc> descs;
+  for (auto &param_name : out_vars) {
+    for (auto &var : param_name.second) {
+      descs.push_back(*var->MutableDesc()->Proto());
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  descs_.Insert(key,
+                std::move(descs),
+                static_cast<size_t>(FLAGS_tape_infer_shape_cache_capacity));
+}
+
+size_t InferShapeCache::Size() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return descs_.Size();
+}
+
+std::vector<framework::Variable *> FlattenVariables(
+    const VariableHandleMap &in_vars, const VariableHandleMap &out_vars) {
+  std::vector<framework::Variable *> vars;
+  for (auto &param2var : in_vars) {
+    for (auto &var : param2var.second) {
+      vars.push_back(var->MutableVar());
+    }
+  }
+  for (auto &param2var : out_vars) {
+    for (auto &var : param2var.second) {
+      vars.push_back(var->MutableVar());
+    }
+  }
+  return vars;
+}
+
+}  // namespace tape
+}  // namespace paddle
@@ -0,0 +1,197 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <mutex>  // NOLINT
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "paddle/fluid/framework/operator.h"
+#include "paddle/fluid/framework/scope.h"
+#include "paddle/fluid/platform/place.h"
+#include "src/variable.h"
+
+namespace paddle {
+namespace tape {
+
+// Order independent textual fingerprint of an AttributeMap
+std::string AttributeFingerprint(const framework::AttributeMap &attrs);
+
+// Append the fields of desc that shape inference depends on, i.e. all but
+// the name, which differs between iterations
+void AppendDescFingerprint(const framework::VarDesc &desc, std::string *key);
+
+/*
+ * Map from string keys to values that holds at most a given number of them,
+ * the least recently used is evicted first. Not thread safe, the caches
+ * below use it under their mutex.
+ */
+template <typename Value>
+class LruCache {
+ public:
+  // nullptr on miss, a hit becomes the most recently used
+  Value *Find(const std::string &key) {
+    auto it = index_.find(key);
+    if (it == index_.end()) return nullptr;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    return &it->second->second;
+  }
+
+  // Insert value unless key is cached already, then evict down to capacity
+  // values, keeping the one of key. Return the cached value and whether it
+  // was inserted.
+  std::pair<Value *, bool> Insert(const std::string &key,
+                                  Value value,
+                                  size_t capacity) {
+    Value *cached = Find(key);
+    bool inserted = cached == nullptr;
+    if (inserted) {
+      entries_.emplace_front(key, std::move(value));
+      index_[key] = entries_.begin();
+      cached = &entries_.front().second;
+    }
+    while (entries_.size() > std::max<size_t>(capacity, 1)) {
+      index_.erase(entries_.back().first);
+      entries_.pop_back();
+    }
+    return std::make_pair(cached, inserted);
+  }
+
+  size_t Size() const { return entries_.size(); }
+
+ private:
+  using Entry = std::pair<std::string, Value>;
+  // Most recently used first
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, typename std::list<Entry>::iterator> index_;
+};
+
+/*
+ * A Scope whose Variables are bound by slot index instead of by name.
+ *
+ * The name to Variable map is built once from the argument names of a
+ * CachedOperator. Binding the Variables of an OpHandle only overwrites the
+ * pre-resolved map entries, nothing is inserted, erased or looked up.
+ */
+class SlotScope : public framework::Scope {
+ public:
+  explicit SlotScope(const std::vector<std::string> &names);
+  ~SlotScope();
+
+  // Not own
+  void Bind(const std::vector<framework::Variable *> &vars);
+  void Unbind();
+
+ private:
+  std::vector<std::unique_ptr<framework::Variable> *> slots_;
+};
+
+/*
+ * An OperatorBase that is not bound to any tape::Variable.
+ *
+ * The arguments of the operator are named after their slot instead of the
+ * Variable, e.g. the first input of parameter "X" is named "X@IN0", so the
+ * same operator can be run against the Variables of any OpHandle that has
+ * the same type, attributes and argument layout.
+ */
+class CachedOperator {
+ public:
+  CachedOperator(const std::string &type,
+                 const VariableHandleMap &in_vars,
+                 const VariableHandleMap &out_vars,
+                 const framework::AttributeMap &attrs);
+
+  // Argument names in slot order, inputs first and then outputs
+  const std::vector<std::string> &ArgumentNames() const {
+    return argument_names_;
+  }
+
+  // Run against vars, which are given in the order of ArgumentNames()
+  void Run(const std::vector<framework::Variable *> &vars,
+           const platform::Place &place);
+
+ private:
+  std::vector<std::string> argument_names_;
+  std::unique_ptr<framework::OperatorBase> op_;
+
+  // Idle SlotScopes, one is taken by every running Run()
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<SlotScope>> scopes_;
+};
+
+/*
+ * Process wide cache of CachedOperator keyed by the op type, the
+ * AttributeFingerprint and the number of arguments of every parameter.
+ *
+ * Operators are never evicted, so the returned pointer stays valid for the
+ * lifetime of the process.
+ */
+class OperatorCache {
+ public:
+  static OperatorCache &Instance();
+
+  CachedOperator *Get(const std::string &type,
+                      const VariableHandleMap &in_vars,
+                      const VariableHandleMap &out_vars,
+                      const framework::AttributeMap &attrs);
+
+  size_t Size();
+
+ private:
+  OperatorCache() = default;
+
+  std::mutex mutex_;
+  std::unordered_map<std::string, std::unique_ptr<CachedOperator>> ops_;
+};
+
+/*
+ * Process wide cache of the output VarDescs inferred by shape inference,
+ * keyed by the op type, the attributes and the VarDescs of all arguments.
+ *
+ * At most FLAGS_tape_infer_shape_cache_capacity keys are kept, the least
+ * recently used is evicted first.
+ */
+class InferShapeCache {
+ public:
+  static InferShapeCache &Instance();
+
+  static std::string Key(const std::string &type,
+                         const VariableHandleMap &in_vars,
+                         const VariableHandleMap &out_vars,
+                         const framework::AttributeMap &attrs);
+
+  // Write the cached output VarDescs into out_vars, return false on miss
+  bool Lookup(const std::string &key, VariableHandleMap *out_vars);
+  void Insert(const std::string &key, const VariableHandleMap &out_vars);
+
+  size_t Size();
+
+ private:
+  InferShapeCache() = default;
+
+  std::mutex mutex_;
+  LruCache<std::vector<framework::proto::VarDesc>> descs_;
+};
+
+// Variables of an OpHandle in the slot order of CachedOperator
+std::vector<framework::Variable *> FlattenVariables(
+    const VariableHandleMap &in_vars, const VariableHandleMap &out_vars);
+
+}  // namespace tape
+}  // namespace paddle
@@ -0,0 +1,168 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/optimizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "src/constant_cache.h"
+#include "src/tape.h"
+
+namespace paddle {
+namespace tape {
+
+namespace {
+
+// Elements updated by one task, large enough to amortize the dispatch
+constexpr int64_t kChunkSize = 1 << 16;
+
+struct Chunk {
+  float *param;
+  const float *grad;
+  float *states[MultiTensorOptimizer::kMaxStates];
+  int64_t step;
+  int64_t size;
+};
+
+}  // namespace
+
+constexpr size_t MultiTensorOptimizer::kMaxStates;
+
+MultiTensorOptimizer::MultiTensorOptimizer(size_t num_threads) {
+  if (num_threads > 1) {
+    ExecutionStrategy strategy;
+    strategy.num_threads = num_threads;
+    executor_.reset(new ParallelExecutor(strategy));
+  }
+}
+
+void MultiTensorOptimizer::Update(const std::vector<VariableHandle> &params) {
+  PADDLE_ENFORCE(get_global_tape().HasBeenBackwarded(),
+                 "optimization must happen after the backward");
+  PADDLE_ENFORCE_LE(NumStates(), kMaxStates);
+
+  std::vector<Chunk> chunks;
+  for (auto &param : params) {
+    VariableHandle grad = param->ExistingGrad();
+    if (grad == nullptr || !grad->Var().IsInitialized()) continue;
+
+    // The parameter may still share the cached constant it was filled with
+    ConstantCache::Instance().Detach(param.get());
+    auto *param_tensor =
+        param->MutableVar()->GetMutable<framework::LoDTensor>();
+    auto &grad_tensor = grad->Var().Get<framework::LoDTensor>();
+    PADDLE_ENFORCE_EQ(param_tensor->numel(),
+                      grad_tensor.numel(),
+                      "Gradient of %s does not match its size",
+                      param->Name());
+    int64_t numel = param_tensor->numel();
+
+    auto &param_state = states_[param->Id()];
+    auto &states = param_state.tensors;
+    ++param_state.steps;
+    if (states.empty() && NumStates() > 0) {
+      states.resize(NumStates());
+      for (auto &state : states) {
+        float *data = state.mutable_data<float>(param_tensor->dims(),
+                                                platform::CPUPlace());
+        std::fill(data, data + numel, 0.0f);
+      }
+    }
+
+    float *param_data = param_tensor->data<float>();
+    const float *grad_data = grad_tensor.data<float>();
+    for (int64_t offset = 0; offset < numel; offset += kChunkSize) {
+      Chunk chunk;
+      chunk.param = param_data + offset;
+      chunk.grad = grad_data + offset;
+      for (size_t k = 0; k < states.size(); ++k) {
+        chunk.states[k] = states[k].data<float>() + offset;
+      }
+      chunk.step = param_state.steps;
+      chunk.size = std::min(kChunkSize, numel - offset);
+      chunks.push_back(chunk);
+    }
+  }
+
+  auto update = [this, &chunks](size_t i) {
+    UpdateChunk(chunks[i].param,
+                chunks[i].grad,
+                chunks[i].states,
+                chunks[i].step,
+                chunks[i].size);
+  };
+  if (executor_ == nullptr || chunks.size() < 2) {
+    for (size_t i = 0; i < chunks.size(); ++i) {
+      update(i);
+    }
+    return;
+  }
+  // Chunks are independent of each other
+  executor_->Run(std::vector<std::vector<size_t>>(chunks.size()), update);
+}
+
+void MultiTensorSGD::UpdateChunk(float *param,
+                                 const float *grad,
+                                 float *const *states,
+                                 int64_t step,
+                                 int64_t size) const {
+  for (int64_t i = 0; i < size; ++i) {
+    param[i] -= learning_rate_ * grad[i];
+  }
+}
+
+void MultiTensorMomentum::UpdateChunk(float *param,
+                                      const float *grad,
+                                      float *const *states,
+                                      int64_t step,
+                                      int64_t size) const {
+  float *velocity = states[0];
+  if (use_nesterov_) {
+    for (int64_t i = 0; i < size; ++i) {
+      velocity[i] = momentum_ * velocity[i] + grad[i];
+      param[i] -= (grad[i] + momentum_ * velocity[i]) * learning_rate_;
+    }
+  } else {
+    for (int64_t i = 0; i < size; ++i) {
+      velocity[i] = momentum_ * velocity[i] + grad[i];
+      param[i] -= learning_rate_ * velocity[i];
+    }
+  }
+}
+
+void MultiTensorAdam::UpdateChunk(float *param,
+                                  const float *grad,
+                                  float *const *states,
+                                  int64_t step,
+                                  int64_t size) const {
+  // Bias corrected learning rate of the step of this parameter
+  float beta1_pow = std::pow(beta1_, static_cast<float>(step));
+  float beta2_pow = std::pow(beta2_, static_cast<float>(step));
+  float learning_rate =
+      learning_rate_ * std::sqrt(1 - beta2_pow) / (1 - beta1_pow);
+
+  float *moment1 = states[0];
+  float *moment2 = states[1];
+  for (int64_t i = 0; i < size; ++i) {
+    moment1[i] = beta1_ * moment1[i] + (1 - beta1_) * grad[i];
+    moment2[i] = beta2_ * moment2[i] + (1 - beta2_) * grad[i] * grad[i];
+    param[i] -=
+        learning_rate * moment1[i] / (std::sqrt(moment2[i]) + epsilon_);
+  }
+}
+
+}  // namespace tape
+}  // namespace paddle
@@ -0,0 +1,145 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "paddle/fluid/framework/lod_tensor.h"
+#include "src/executor.h"
+#include "src/variable.h"
+
+namespace paddle {
+namespace tape {
+
+/*
+ * Base of the optimizers that update a whole list of parameters at once.
+ *
+ * Update() cuts the parameters into chunks of contiguous elements and
+ * applies the update rule to every chunk in a single pass over the
+ * parameter, its gradient and its state tensors. With num_threads > 1 the
+ * chunks are spread over a pool of threads. No tape or operator is created.
+ *
+ * Parameters must be FP32 with a dense gradient. A parameter without a
+ * gradient is left unchanged, and does not count the step: the steps are
+ * counted per parameter, whichever Update() call it is passed to.
+ */
+class MultiTensorOptimizer {
+ public:
+  static constexpr size_t kMaxStates = 2;
+
+  explicit MultiTensorOptimizer(size_t num_threads);
+  virtual ~MultiTensorOptimizer() = default;
+
+  void Update(const std::vector<VariableHandle> &params);
+
+ protected:
+  // Number of state tensors of every parameter, zero initialized
+  virtual size_t NumStates() const = 0;
+  // Update size elements, states[k] points at the same elements of state k.
+  // step is the number of updates of the parameter, this one included.
+  virtual void UpdateChunk(float *param,
+                           const float *grad,
+                           float *const *states,
+                           int64_t step,
+                           int64_t size) const = 0;
+
+ private:
+  struct ParamState {
+    std::vector<framework::LoDTensor> tensors;
+    int64_t steps = 0;
+  };
+  // States of the parameters, by Variable::Id()
+  std::unordered_map<int64_t, ParamState> states_;
+  // nullptr updates the chunks on the calling thread
+  std::unique_ptr<ParallelExecutor> executor_;
+};
+
+// param -= learning_rate * grad
+class MultiTensorSGD : public MultiTensorOptimizer {
+ public:
+  explicit MultiTensorSGD(float learning_rate, size_t num_threads = 1)
+      : MultiTensorOptimizer(num_threads), learning_rate_(learning_rate) {}
+
+ protected:
+  size_t NumStates() const override { return 0; }
+  void UpdateChunk(float *param,
+                   const float *grad,
+                   float *const *states,
+                   int64_t step,
+                   int64_t size) const override;
+
+ private:
+  float learning_rate_;
+};
+
+// Same update rule as momentum_op, state is the velocity
+class MultiTensorMomentum : public MultiTensorOptimizer {
+ public:
+  MultiTensorMomentum(float learning_rate,
+                      float momentum,
+                      bool use_nesterov = false,
+                      size_t num_threads = 1)
+      : MultiTensorOptimizer(num_threads),
+        learning_rate_(learning_rate),
+        momentum_(momentum),
+        use_nesterov_(use_nesterov) {}
+
+ protected:
+  size_t NumStates() const override { return 1; }
+  void UpdateChunk(float *param,
+                   const float *grad,
+                   float *const *states,
+                   int64_t step,
+                   int64_t size) const override;
+
+ private:
+  float learning_rate_;
+  float momentum_;
+  bool use_nesterov_;
+};
+
+// Same update rule as adam_op, states are the first and second moments
+class MultiTensorAdam : public MultiTensorOptimizer {
+ public:
+  explicit MultiTensorAdam(float learning_rate,
+                           float beta1 = 0.9f,
+                           float beta2 = 0.999f,
+                           float epsilon = 1e-8f,
+                           size_t num_threads = 1)
+      : MultiTensorOptimizer(num_threads),
+        learning_rate_(learning_rate),
+        beta1_(beta1),
+        beta2_(beta2),
+        epsilon_(epsilon) {}
+
+ protected:
+  size_t NumStates() const override { return 2; }
+  void UpdateChunk(float *param,
+                   const float *grad,
+                   float *const *states,
+                   int64_t step,
+                   int64_t size) const override;
+
+ private:
+  float learning_rate_;
+  float beta1_;
+  float beta2_;
+  float epsilon_;
+};
+
+}  // namespace tape
+}  // namespace paddle
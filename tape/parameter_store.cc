@@ -0,0 +1,143 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/parameter_store.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "paddle/fluid/framework/lod_tensor.h"
+#include "paddle/fluid/platform/device_context.h"
+
+namespace paddle {
+namespace tape {
+
+namespace {
+
+// Make var a LoDTensor viewing [begin, begin + numel) of buffer with dims
+void MakeView(Variable *var,
+              const framework::LoDTensor &buffer,
+              int64_t begin,
+              const framework::DDim &dims) {
+  auto *desc = var->MutableDesc();
+  desc->SetType(framework::proto::VarType::LOD_TENSOR);
+  desc->SetDataType(framework::proto::VarType::FP32);
+  desc->SetShape(framework::vectorize(dims));
+
+  int64_t end = begin + framework::product(dims);
+  auto *tensor = var->MutableVar()->GetMutable<framework::LoDTensor>();
+  tensor->ShareDataWith(
+      buffer.Slice(static_cast<int>(begin), static_cast<int>(end)));
+  tensor->Resize(dims);
+  var->SetSharesConstant(false);
+}
+
+// Allocate a zero filled 1-D buffer of size floats for var
+framework::LoDTensor *MakeBuffer(Variable *var, int64_t size) {
+  auto *desc = var->MutableDesc();
+  desc->SetType(framework::proto::VarType::LOD_TENSOR);
+  desc->SetDataType(framework::proto::VarType::FP32);
+  desc->SetShape({size});
+
+  auto *tensor = var->MutableVar()->GetMutable<framework::LoDTensor>();
+  float *data = tensor->mutable_data<float>(framework::make_ddim({size}),
+                                            platform::CPUPlace());
+  std::fill(data, data + size, 0.0f);
+  var->SetSharesConstant(false);
+  return tensor;
+}
+
+}  // namespace
+
+constexpr size_t ParameterStore::kAlignment;
+
+ParameterStore::ParameterStore(const std::vector<VariableHandle> &params)
+    : params_(params) {
+  const int64_t align = kAlignment / sizeof(float);
+  std::vector<int64_t> offsets;
+  int64_t size = 0;
+  for (auto &param : params_) {
+    auto &tensor = param->Var().Get<framework::LoDTensor>();
+    PADDLE_ENFORCE(tensor.type() == typeid(float),
+                   "Parameter %s is not FP32",
+                   param->Name());
+    offsets.push_back(size);
+    size += (tensor.numel() + align - 1) / align * align;
+  }
+
+  flat_param_.reset(new Variable("parameters"));
+  flat_grad_ = flat_param_->Grad();
+  auto *flat_param = MakeBuffer(flat_param_.get(), size);
+  auto *flat_grad = MakeBuffer(flat_grad_.get(), size);
+
+  for (size_t i = 0; i < params_.size(); ++i) {
+    auto &param = params_[i];
+    // Holds the old data until it has been copied
+    framework::LoDTensor old = param->Var().Get<framework::LoDTensor>();
+    MakeView(param.get(), *flat_param, offsets[i], old.dims());
+    std::memcpy(flat_param->data<float>() + offsets[i],
+                old.data<float>(),
+                old.numel() * sizeof(float));
+
+    grads_.push_back(param->Grad());
+    MakeView(grads_.back().get(), *flat_grad, offsets[i], old.dims());
+  }
+}
+
+void ParameterStore::ZeroGrad() {
+  auto *flat_grad =
+      flat_grad_->MutableVar()->GetMutable<framework::LoDTensor>();
+  float *data = flat_grad->data<float>();
+  std::fill(data, data + flat_grad->numel(), 0.0f);
+}
+
+float ParameterStore::GradNorm() const {
+  auto &flat_grad = flat_grad_->Var().Get<framework::LoDTensor>();
+  const float *data = flat_grad.data<float>();
+  double sum = 0;
+  for (int64_t i = 0; i < flat_grad.numel(); ++i) {
+    sum += static_cast<double>(data[i]) * data[i];
+  }
+  return static_cast<float>(std::sqrt(sum));
+}
+
+void ParameterStore::Save(std::ostream &os) const {
+  auto &dev_ctx =
+      *platform::DeviceContextPool::Instance().Get(platform::CPUPlace());
+  framework::SerializeToStream(
+      os, flat_param_->Var().Get<framework::LoDTensor>(), dev_ctx);
+}
+
+void ParameterStore::Load(std::istream &is) {
+  auto &dev_ctx =
+      *platform::DeviceContextPool::Instance().Get(platform::CPUPlace());
+  framework::LoDTensor loaded;
+  framework::DeserializeFromStream(is, &loaded, dev_ctx);
+
+  // Copy into the buffer, the parameters keep viewing it
+  auto *flat_param =
+      flat_param_->MutableVar()->GetMutable<framework::LoDTensor>();
+  PADDLE_ENFORCE(loaded.type() == typeid(float) &&
+                     loaded.dims() == flat_param->dims(),
+                 "Loaded parameters do not match the layout of the store");
+  std::memcpy(flat_param->data<float>(),
+              loaded.data<float>(),
+              loaded.numel() * sizeof(float));
+}
+
+}  // namespace tape
+}  // namespace paddle
@@ -0,0 +1,67 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#pragma once
+
+#include <iostream>
+#include <vector>
+
+#include "src/variable.h"
+
+namespace paddle {
+namespace tape {
+
+/*
+ * Packs FP32 parameters into one contiguous buffer, and their gradients
+ * into a parallel buffer of the same layout.
+ *
+ * Every parameter, and the gradient returned by its Grad(), becomes a view
+ * of its range in the buffers, so ops read and write the buffers in place.
+ * Ranges start at a multiple of kAlignment bytes from the buffer start.
+ *
+ * FlatParam() is the whole parameter buffer as a single Variable whose
+ * Grad() is the gradient buffer. Handing it to a MultiTensorOptimizer
+ * updates all the parameters in one streaming pass.
+ *
+ * A gradient keeps its value until an op writes it again. Call ZeroGrad()
+ * before Backward() if some parameters may not receive a gradient.
+ */
+class ParameterStore {
+ public:
+  static constexpr size_t kAlignment = 64;
+
+  // The data of params is moved into the store. A parameter must not be
+  // handed to two stores.
+  explicit ParameterStore(const std::vector<VariableHandle> &params);
+
+  const std::vector<VariableHandle> &Params() const { return params_; }
+  VariableHandle FlatParam() const { return flat_param_; }
+
+  void ZeroGrad();
+  // L2 norm of all the gradients
+  float GradNorm() const;
+
+  // Save / load the parameters, Load() requires the same layout
+  void Save(std::ostream &os) const;
+  void Load(std::istream &is);
+
+ private:
+  std::vector<VariableHandle> params_;
+  // Own the gradients of params_, which only hold them weakly
+  std::vector<VariableHandle> grads_;
+  VariableHandle flat_param_;
+  VariableHandle flat_grad_;
+};
+
+}  // namespace tape
+}  // namespace paddle
@@ -14,19 +14,46 @@
 
 #include "src/tape.h"
 
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <istream>
 #include <list>
 #include <map>
 #include <memory>
+#include <mutex>  // NOLINT
+#include <ostream>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include "gflags/gflags.h"
 #include "paddle/fluid/framework/data_type.h"
 #include "paddle/fluid/framework/dim.h"
 #include "paddle/fluid/framework/op_registry.h"
 #include "paddle/fluid/framework/operator.h"
+#include "paddle/fluid/framework/program_desc.h"
 #include "paddle/fluid/framework/scope.h"
+#include "paddle/fluid/platform/device_context.h"
 #include "paddle/fluid/platform/place.h"
+#include "paddle/fluid/platform/profiler.h"
 #include "paddle/fluid/pybind/pybind.h"
+#include "src/backward_cache.h"
+#include "src/constant_cache.h"
+#include "src/cse.h"
+#include "src/fusion.h"
+#include "src/inplace.h"
+#include "src/memory_planner.h"
+
+DEFINE_bool(tape_cache_infer_shape,
+            true,
+            "If set, Tape::AddOp reuses the inferred output VarDescs of ops "
+            "with the same type, attributes and input VarDescs.");
+DECLARE_bool(tape_cache_operators);
+DECLARE_bool(tape_plan_memory);
+DECLARE_bool(tape_cache_backward);
 
 namespace paddle {
 namespace tape {
@@ -75,23 +102,52 @@ framework::OpDesc CreateOpDesc(const std::string &type,
                                const framework::AttributeMap &attrs) {
   framework::VariableNameMap inputs;
   for (auto &param_name : in_vars) {
+    auto &names = inputs[param_name.first];
     for (auto &var : param_name.second) {
-      inputs[param_name.first].emplace_back(var->Name());
+      names.emplace_back(var->Name());
     }
   }
   framework::VariableNameMap outputs;
   for (auto &param_name : out_vars) {
+    auto &names = outputs[param_name.first];
     for (auto &var : param_name.second) {
-      outputs[param_name.first].emplace_back(var->Name());
+      names.emplace_back(var->Name());
     }
   }
   return framework::OpDesc(type, inputs, outputs, attrs);
 }
 
+// Record the enclosing scope as a profiler event. name() is only called,
+// and the event only created, when the profiler is enabled.
+template <typename NameFn>
+std::unique_ptr<platform::RecordEvent> ProfileEvent(NameFn name) {
+  if (!platform::IsProfileEnabled()) return nullptr;
+  auto *dev_ctx =
+      platform::DeviceContextPool::Instance().Get(platform::CPUPlace());
+  return std::unique_ptr<platform::RecordEvent>(
+      new platform::RecordEvent(name(), dev_ctx));
+}
+
+// Run an op and release what it does not need any more, defined below
+void RunSingleOp(OpHandle *op,
+                 const std::string &tape_name,
+                 size_t position,
+                 const Variable *inplace_input = nullptr);
+
 void InferShapeAndVarType(const std::string &type,
                           const VariableHandleMap &in_vars,
                           VariableHandleMap *out_vars,
                           const framework::AttributeMap &attrs) {
+  auto event = ProfileEvent([&type] { return "tape/infer_shape/" + type; });
+  std::string key;
+  if (FLAGS_tape_cache_infer_shape) {
+    key = InferShapeCache::Key(type, in_vars, *out_vars, attrs);
+    if (InferShapeCache::Instance().Lookup(key, out_vars)) {
+      VLOG(3) << "+ " << to_string(type, in_vars, *out_vars, attrs);
+      return;
+    }
+  }
+
   framework::OpDesc op_desc = CreateOpDesc(type, in_vars, *out_vars, attrs);
 
   // Create a temporary block for compile-time
@@ -110,7 +166,7 @@ void InferShapeAndVarType(const std::string &type,
     }
   }
 
-  LOG(INFO) << "- " << to_string(type, in_vars, *out_vars, attrs);
+  VLOG(3) << "- " << to_string(type, in_vars, *out_vars, attrs);
   op_desc.InferShape(*block_desc);
   op_desc.InferVarType(block_desc);
   for (auto &param_name : *out_vars) {
@@ -118,15 +174,144 @@ void InferShapeAndVarType(const std::string &type,
       *var->MutableDesc()->Proto() = *block_desc->Var(var->Name())->Proto();
     }
   }
-  LOG(INFO) << "+ " << to_string(type, in_vars, *out_vars, attrs);
+  VLOG(3) << "+ " << to_string(type, in_vars, *out_vars, attrs);
+
+  if (FLAGS_tape_cache_infer_shape) {
+    InferShapeCache::Instance().Insert(key, *out_vars);
+  }
 }
 
 void Tape::AddOp(const std::string &type,
-                 const VariableHandleMap &in_vars,
+                 VariableHandleMap in_vars,
                  VariableHandleMap out_vars,
-                 const framework::AttributeMap &attrs) {
+                 framework::AttributeMap attrs) {
+  if (!IsGradEnabled()) {
+    RunNoGrad(type, std::move(in_vars), std::move(out_vars), std::move(attrs));
+    return;
+  }
+  RecordOp(type, std::move(in_vars), std::move(out_vars), std::move(attrs));
+}
+
+void Tape::RecordOp(const std::string &type,
+                    VariableHandleMap in_vars,
+                    VariableHandleMap out_vars,
+                    framework::AttributeMap attrs) {
+  PADDLE_ENFORCE(!frozen_, "Can not add op %s to a frozen tape", type);
+  if (async_) {
+    // Shape inference rewrites the VarDesc of the outputs
+    for (auto &param2var : out_vars) {
+      for (auto &var : param2var.second) {
+        WaitForUses(var.get());
+      }
+    }
+  }
+  InferShapeAndVarType(type, in_vars, &out_vars, attrs);
+  tape_.emplace_back(
+      type, std::move(in_vars), std::move(out_vars), std::move(attrs));
+  for (auto &param2var : tape_.back().inputs_) {
+    for (auto &var : param2var.second) {
+      tape_.back().input_versions_.push_back(var->Version());
+    }
+  }
+  if (async_) {
+    SubmitAsync();
+  }
+}
+
+void Tape::RunNoGrad(const std::string &type,
+                     VariableHandleMap in_vars,
+                     VariableHandleMap out_vars,
+                     framework::AttributeMap attrs) {
+  // The inputs may be written by ops recorded before
+  if (async_) {
+    for (auto &param2var : in_vars) {
+      for (auto &var : param2var.second) {
+        Evaluate(var.get());
+      }
+    }
+    for (auto &param2var : out_vars) {
+      for (auto &var : param2var.second) {
+        WaitForUses(var.get());
+      }
+    }
+  } else if (checkpointing_) {
+    if (current_position_ < tape_.size()) Forward();
+  } else {
+    std::unordered_set<const Variable *> reads;
+    std::unordered_set<const Variable *> writes;
+    for (auto &param2var : in_vars) {
+      for (auto &var : param2var.second) reads.insert(var.get());
+    }
+    for (auto &param2var : out_vars) {
+      for (auto &var : param2var.second) writes.insert(var.get());
+    }
+    RunAhead(std::move(reads), std::move(writes));
+  }
   InferShapeAndVarType(type, in_vars, &out_vars, attrs);
-  tape_.emplace_back(type, in_vars, out_vars, attrs);
+
+  // Dropped once run, so are the references to the Variables
+  OpHandle op(type, std::move(in_vars), std::move(out_vars), std::move(attrs));
+  for (auto &param2var : op.inputs_) {
+    for (auto &var : param2var.second) {
+      op.input_versions_.push_back(var->Version());
+    }
+  }
+  RunSingleOp(&op, "no_grad", tape_.size());
+}
+
+void Tape::SubmitAsync() {
+  OpHandle *op = &tape_.back();
+  size_t position = tape_.size() - 1;
+  std::string name = name_;
+  size_t task = async_->Submit(
+      [op, position, name] { RunSingleOp(op, name, position); });
+
+  for (auto &param2var : op->inputs_) {
+    for (auto &var : param2var.second) {
+      last_use_task_[var.get()] = task;
+    }
+  }
+  for (auto &param2var : op->outputs_) {
+    for (auto &var : param2var.second) {
+      last_write_task_[var.get()] = task;
+      last_use_task_[var.get()] = task;
+    }
+  }
+}
+
+void Tape::WaitForUses(const Variable *var) {
+  auto it = last_use_task_.find(var);
+  if (it != last_use_task_.end()) {
+    async_->Wait(it->second);
+  }
+}
+
+void Tape::EnableAsync() {
+  PADDLE_ENFORCE(tape_.empty(), "Async mode is enabled on an empty tape");
+  PADDLE_ENFORCE(!checkpointing_, "Async mode does not support checkpointing");
+  if (async_ == nullptr) {
+    async_.reset(new AsyncExecutor());
+  }
+}
+
+void Tape::Evaluate(const Variable *var) {
+  if (async_ == nullptr) {
+    if (checkpointing_) {
+      Forward();
+    } else {
+      RunAhead({var}, {});
+    }
+    return;
+  }
+  auto it = last_write_task_.find(var);
+  if (it != last_write_task_.end()) {
+    async_->Wait(it->second);
+  }
+}
+
+Tape::~Tape() {
+  // Stop the worker before the ops it may be running are destroyed
+  async_.reset();
 }
 
 // Temporary Scope for Operator::Run()
@@ -157,109 +342,1083 @@ class ScopeWrapper : public framework::Scope {
   }
 };
 
+// inplace_input is the input whose storage the op overwrites, if any
+void ExecuteOp(OpHandle *op, const Variable *inplace_input = nullptr) {
+  size_t k = 0;
+  for (auto &param2var : op->inputs_) {
+    for (auto &var : param2var.second) {
+      PADDLE_ENFORCE(var.get() == inplace_input ||
+                         var->Version() == op->input_versions_[k],
+                     "%s has been overwritten in place before %s reads it",
+                     var->Name(),
+                     op->type_);
+      ++k;
+    }
+  }
+
+  if (IsEliminated(*op)) {
+    ShareSourceOutputs(op);
+    return;
+  }
+
+  auto &constants = ConstantCache::Instance();
+  std::string constant_key = constants.Key(*op);
+  if (!constant_key.empty() && constants.Lookup(constant_key, op)) return;
+
+  // Create Output Tensor, this is only necessary for OpWithKernel
+  for (auto &param2var : op->outputs_) {
+    for (auto &var : param2var.second) {
+      var->InitializeVariable();
+      constants.Detach(var.get());
+    }
+  }
+
+  auto create_event = [op] { return "tape/create_op/" + op->type_; };
+  auto run_event = [op] { return "tape/run/" + op->type_; };
+  if (FLAGS_tape_cache_operators) {
+    if (op->cached_op_ == nullptr) {
+      auto event = ProfileEvent(create_event);
+      op->cached_op_ = OperatorCache::Instance().Get(
+          op->type_, op->inputs_, op->outputs_, op->attrs_);
+      op->flat_vars_ = FlattenVariables(op->inputs_, op->outputs_);
+    }
+    auto event = ProfileEvent(run_event);
+    op->cached_op_->Run(op->flat_vars_, platform::CPUPlace());
+  } else {
+    std::unique_ptr<framework::OperatorBase> op_base;
+    {
+      auto event = ProfileEvent(create_event);
+      op_base = framework::OpRegistry::CreateOp(
+          CreateOpDesc(op->type_, op->inputs_, op->outputs_, op->attrs_));
+    }
+    ScopeWrapper scope(op->inputs_, op->outputs_);
+    auto event = ProfileEvent(run_event);
+    op_base->Run(scope, platform::CPUPlace());
+  }
+
+  if (!constant_key.empty()) {
+    constants.Insert(constant_key, *op);
+  }
+}
+
+void ReleaseAfterRun(OpHandle *op) {
+  for (auto *var : op->release_after_run_) {
+    var->MutableVar()->Clear();
+  }
+}
+
+// The profiler event of an op is named after its tape, position and type
+void RunSingleOp(OpHandle *op,
+                 const std::string &tape_name,
+                 size_t position,
+                 const Variable *inplace_input) {
+  auto event = ProfileEvent([&] {
+    return tape_name + "#" + std::to_string(position) + "/" + op->type_;
+  });
+  ExecuteOp(op, inplace_input);
+  ReleaseAfterRun(op);
+}
+
+// Run op begin + i of tape, together with the op fused into it by plan, or
+// in place as planned by inplace
+void RunOp(OpHandleList *tape,
+           const FusionPlan &plan,
+           const InplacePlan &inplace,
+           const std::string &tape_name,
+           size_t begin,
+           size_t i) {
+  if (plan.skip[i]) return;
+  OpHandle *op = &(*tape)[begin + i];
+  if (plan.producer[i] == FusionPlan::kNotFused) {
+    Variable *input = inplace.input[i];
+    // A cached constant must not be overwritten
+    if (input != nullptr && ConstantCache::Instance().Holds(*input)) {
+      input = nullptr;
+    }
+    if (input != nullptr) {
+      // The kernel reuses the storage Out already holds
+      Variable *output = inplace.output[i];
+      output->InitializeVariable();
+      output->MutableVar()->GetMutable<framework::LoDTensor>()->ShareDataWith(
+          input->Var().Get<framework::LoDTensor>());
+      output->SetSharesConstant(false);
+    }
+    RunSingleOp(op, tape_name, begin + i, input);
+    if (input != nullptr) {
+      input->BumpVersion();
+    }
+    return;
+  }
+
+  OpHandle *producer = &(*tape)[begin + plan.producer[i]];
+  auto event = ProfileEvent([&] {
+    return tape_name + "#" + std::to_string(begin + i) + "/" +
+           producer->type_ + "+" + op->type_;
+  });
+  for (auto *fused : {producer, op}) {
+    for (auto &param2var : fused->outputs_) {
+      for (auto &var : param2var.second) {
+        ConstantCache::Instance().Detach(var.get());
+      }
+    }
+  }
+  if (!RunFused(producer, op, plan.elide[i])) {
+    ExecuteOp(producer);
+    ExecuteOp(op);
+  }
+  ReleaseAfterRun(producer);
+  ReleaseAfterRun(op);
+}
+
+// deps[i] lists the ops in [begin, end) that op begin + i has to wait for,
+// relative to begin. An op waits for the last writer of every Variable it
+// reads or writes, and for the readers of every Variable it writes or
+// releases since that Variable was last written. A fused op accesses the
+// Variables of its producer, which accesses none on its own.
+std::vector<std::vector<size_t>> Dependencies(const OpHandleList &tape,
+                                              const FusionPlan &plan,
+                                              size_t begin,
+                                              size_t end) {
+  std::unordered_map<Variable *, size_t> last_writer;
+  std::unordered_map<Variable *, std::vector<size_t>> readers;
+  std::vector<std::vector<size_t>> deps(end - begin);
+
+  for (size_t i = 0; i < deps.size(); ++i) {
+    if (plan.skip[i]) continue;
+    auto write = [&](Variable *var) {
+      auto writer = last_writer.find(var);
+      if (writer != last_writer.end()) deps[i].push_back(writer->second);
+      for (size_t reader : readers[var]) {
+        if (reader != i) deps[i].push_back(reader);
+      }
+      readers[var].clear();
+      last_writer[var] = i;
+    };
+    auto access = [&](const OpHandle &op) {
+      for (auto &param2var : op.inputs_) {
+        for (auto &var : param2var.second) {
+          auto writer = last_writer.find(var.get());
+          if (writer != last_writer.end()) deps[i].push_back(writer->second);
+          readers[var.get()].push_back(i);
+        }
+      }
+      for (auto &param2var : op.outputs_) {
+        for (auto &var : param2var.second) {
+          write(var.get());
+        }
+      }
+      for (auto *var : op.release_after_run_) {
+        write(var);
+      }
+    };
+
+    if (plan.producer[i] != FusionPlan::kNotFused) {
+      access(tape[begin + plan.producer[i]]);
+    }
+    access(tape[begin + i]);
+
+    // the consumer of a fused chain reads what its producer wrote
+    deps[i].erase(std::remove(deps[i].begin(), deps[i].end(), i),
+                  deps[i].end());
+    std::sort(deps[i].begin(), deps[i].end());
+    deps[i].erase(std::unique(deps[i].begin(), deps[i].end()), deps[i].end());
+  }
+  return deps;
+}
+
+struct Tape::RangePlan {
+  RangePlan(FusionPlan fusion, InplacePlan inplace)
+      : fusion(std::move(fusion)), inplace(std::move(inplace)) {}
+
+  FusionPlan fusion;
+  InplacePlan inplace;
+  // Dependencies() of the ops, if they are run by executor_
+  std::vector<std::vector<size_t>> deps;
+};
+
+void Tape::RunOps(size_t begin, size_t end) {
+  // The ops run ahead by Evaluate() are skipped, the others run one by one
+  bool run_ahead = false;
+  for (size_t i = begin; i < end; ++i) {
+    run_ahead = run_ahead || tape_[i].run_ahead_;
+  }
+  if (run_ahead) {
+    for (size_t i = begin; i < end; ++i) {
+      if (tape_[i].run_ahead_) {
+        tape_[i].run_ahead_ = false;
+      } else {
+        RunSingleOp(&tape_[i], name_, i);
+      }
+    }
+    return;
+  }
+
+  std::shared_ptr<const RangePlan> plan = PlanRange(begin, end);
+  auto &fusion = plan->fusion;
+  auto &inplace = plan->inplace;
+  if (executor_ == nullptr || end - begin < 2) {
+    for (size_t i = 0; i < end - begin; ++i) {
+      RunOp(&tape_, fusion, inplace, name_, begin, i);
+    }
+    return;
+  }
+  executor_->Run(plan->deps, [this, &fusion, &inplace, begin](size_t i) {
+    RunOp(&tape_, fusion, inplace, name_, begin, i);
+  });
+}
+
+std::shared_ptr<const Tape::RangePlan> Tape::PlanRange(size_t begin,
+                                                       size_t end) {
+  auto range = std::make_pair(begin, end);
+  if (frozen_) {
+    auto it = range_plans_.find(range);
+    if (it != range_plans_.end()) return it->second;
+  }
+
+  // Recomputed segments may not read what they no longer compute
+  if (!checkpointing_) {
+    EliminateCommonSubexpressions(&tape_, begin, end);
+  }
+  FusionPlan fusion = PlanFusion(tape_, begin, end);
+  // Planned Variables have their own range of the arena, and recomputed
+  // segments read the inputs they were recorded with
+  InplacePlan inplace = memory_planned_ || checkpointing_
+                            ? InplacePlan(end - begin)
+                            : PlanInplace(tape_, begin, end, fusion);
+  auto plan = std::make_shared<RangePlan>(std::move(fusion),
+                                          std::move(inplace));
+  if (executor_ != nullptr && end - begin >= 2) {
+    plan->deps = Dependencies(tape_, plan->fusion, begin, end);
+  }
+  if (frozen_) {
+    range_plans_[range] = plan;
+  }
+  return plan;
+}
+
 void Tape::Forward() {
-  LOG(INFO) << "Starting forward -------------------------";
   PADDLE_ENFORCE(!has_been_backwarded_);
-  while (current_position_ < tape_.size()) {
-    OpHandle &op = tape_[current_position_];
+  if (async_) {
+    async_->WaitAll();
+    current_position_ = tape_.size();
+    return;
+  }
+  RunForward();
+}
 
-    // Create Output Tensor, this is only necessary for OpWithKernel
+void Tape::RunAhead(std::unordered_set<const Variable *> reads,
+                    std::unordered_set<const Variable *> writes) {
+  // From the last op back, an op is needed if it writes a Variable read by
+  // a later needed op, or uses a Variable written by one
+  std::vector<size_t> needed;
+  size_t pending = 0;
+  for (size_t i = tape_.size(); i-- > current_position_;) {
+    OpHandle &op = tape_[i];
+    if (op.run_ahead_) continue;
+    ++pending;
+    bool need = false;
+    for (auto &param2var : op.inputs_) {
+      for (auto &var : param2var.second) {
+        need = need || writes.count(var.get());
+      }
+    }
     for (auto &param2var : op.outputs_) {
       for (auto &var : param2var.second) {
-        var->InitializeVariable();
+        need = need || reads.count(var.get()) || writes.count(var.get());
       }
     }
+    if (!need) continue;
+    needed.push_back(i);
+    for (auto &param2var : op.inputs_) {
+      for (auto &var : param2var.second) reads.insert(var.get());
+    }
+    for (auto &param2var : op.outputs_) {
+      for (auto &var : param2var.second) writes.insert(var.get());
+    }
+  }
 
-    framework::OpDesc op_desc =
-        CreateOpDesc(op.type_, op.inputs_, op.outputs_, op.attrs_);
-    ScopeWrapper scope(op.inputs_, op.outputs_);
-    framework::OpRegistry::CreateOp(op_desc)->Run(scope, platform::CPUPlace());
-    current_position_++;
+  // Everything is needed, run the tape with its fusion and execution plans
+  if (needed.size() == pending) {
+    RunForward();
+    return;
+  }
+  for (auto it = needed.rbegin(); it != needed.rend(); ++it) {
+    RunSingleOp(&tape_[*it], name_, *it);
+    tape_[*it].run_ahead_ = true;
+  }
+  while (current_position_ < tape_.size() &&
+         tape_[current_position_].run_ahead_) {
+    tape_[current_position_++].run_ahead_ = false;
   }
+}
+
+void Tape::RunForward() {
+  VLOG(3) << "Starting " << name_ << " -------------------------";
+  while (current_position_ < tape_.size()) {
+    size_t end = current_position_ + 1;
+    while (end < tape_.size() && !(checkpointing_ && IsSegmentEnd(end))) {
+      ++end;
+    }
+
+    RunOps(current_position_, end);
+    current_position_ = end;
 
-  LOG(INFO) << "Finishing forward -------------------------";
+    if (checkpointing_ && IsSegmentEnd(current_position_)) {
+      EndSegment(current_position_);
+    }
+  }
+
+  VLOG(3) << "Finishing " << name_ << " -------------------------";
+}
+
+void Tape::SetExecutionStrategy(const ExecutionStrategy &strategy) {
+  if (strategy.num_threads > 1) {
+    executor_.reset(new ParallelExecutor(strategy));
+  } else {
+    executor_.reset();
+  }
+  // The plans of a frozen tape depend on whether there is an executor
+  range_plans_.clear();
+}
+
+// Mark the ops on a path from a Variable that requires gradient to target.
+//
+// A Variable requires gradient if it does not stop gradient and it is either
+// not computed by the tape, e.g. a parameter, or it is computed by an op
+// that has an input requiring gradient.
+std::vector<bool> OpsToDifferentiate(const OpHandleList &tape,
+                                     const Variable *target,
+                                     std::unordered_set<Variable *> *requires) {
+  std::unordered_set<Variable *> computed;
+  std::vector<bool> has_grad_input(tape.size(), false);
+  for (size_t i = 0; i < tape.size(); ++i) {
+    for (auto &param2var : tape[i].inputs_) {
+      for (auto &var : param2var.second) {
+        if (var->StopGradient()) continue;
+        if (requires->count(var.get()) || !computed.count(var.get())) {
+          requires->insert(var.get());
+          has_grad_input[i] = true;
+        }
+      }
+    }
+    for (auto &param2var : tape[i].outputs_) {
+      for (auto &var : param2var.second) {
+        computed.insert(var.get());
+        if (has_grad_input[i] && !var->StopGradient()) {
+          requires->insert(var.get());
+        } else {
+          requires->erase(var.get());
+        }
+      }
+    }
+  }
+
+  std::unordered_set<const Variable *> reach_target{target};
+  std::vector<bool> differentiate(tape.size(), false);
+  for (size_t i = tape.size(); i-- > 0;) {
+    if (!has_grad_input[i]) continue;
+    for (auto &param2var : tape[i].outputs_) {
+      for (auto &var : param2var.second) {
+        differentiate[i] = differentiate[i] || reach_target.count(var.get());
+      }
+    }
+    if (!differentiate[i]) continue;
+    for (auto &param2var : tape[i].inputs_) {
+      for (auto &var : param2var.second) {
+        if (requires->count(var.get())) {
+          reach_target.insert(var.get());
+        }
+      }
+    }
+  }
+  return differentiate;
+}
+
+// Release the storage of an intermediate Variable, i.e. one computed by the
+// forward tape, and of its gradient right after their last use on the
+// backward tape. Variables that are also held outside of the tapes, like the
+// target or a Variable the user keeps, are left alone, and so are those of
+// the forward ops from position on that have not run, which may still be
+// evaluated.
+void ScheduleRelease(const OpHandleList &forward,
+                     size_t position,
+                     const Variable *target,
+                     OpHandleList *backward) {
+  std::unordered_map<Variable *, int64_t> tape_refs;
+  std::unordered_map<Variable *, size_t> last_use;
+  for (auto *tape : {&forward, static_cast<const OpHandleList *>(
+                                   backward)}) {
+    for (size_t i = 0; i < tape->size(); ++i) {
+      for (auto *vars : {&(*tape)[i].inputs_, &(*tape)[i].outputs_}) {
+        for (auto &param2var : *vars) {
+          for (auto &var : param2var.second) {
+            tape_refs[var.get()]++;
+            if (tape == backward) last_use[var.get()] = i;
+          }
+        }
+      }
+    }
+  }
+  std::unordered_set<const Variable *> pending;
+  for (size_t i = position; i < forward.size(); ++i) {
+    if (forward[i].run_ahead_) continue;
+    for (auto *vars : {&forward[i].inputs_, &forward[i].outputs_}) {
+      for (auto &param2var : *vars) {
+        for (auto &var : param2var.second) {
+          pending.insert(var.get());
+        }
+      }
+    }
+  }
+
+  auto release = [&](VariableHandle var) {
+    if (var == nullptr || var.get() == target || pending.count(var.get())) {
+      return;
+    }
+    // var itself holds one reference
+    if (var.use_count() - 1 > tape_refs[var.get()]) return;
+    // Not used by backward at all, release it before the first grad op
+    size_t position = last_use.count(var.get()) ? last_use[var.get()] : 0;
+    (*backward)[position].release_after_run_.push_back(var.get());
+  };
+
+  std::unordered_set<Variable *> intermediates;
+  for (auto &op : forward) {
+    for (auto &param2var : op.outputs_) {
+      for (auto &var : param2var.second) {
+        if (!intermediates.insert(var.get()).second) continue;
+        release(var);
+        release(var->ExistingGrad());
+      }
+    }
+  }
 }
 
 void Tape::Backward(VariableHandle target) {
   PADDLE_ENFORCE(!has_been_backwarded_);
+  // The memory plan of a frozen tape covers the recorded ops only
+  PADDLE_ENFORCE(!frozen_, "Can not add grad ops to a frozen tape");
 
-  Forward();
+  // Ops target does not depend on are left pending, they run when one of
+  // their outputs is evaluated or the tape is replayed
+  if (checkpointing_ || async_) {
+    Forward();
+  } else {
+    RunAhead({target.get()}, {});
+  }
 
   // TODO(tonyyang-svail): check output of last op is target
   backward_tape_.reset(new Tape());
+  backward_tape_->name_ = "backward";
+  backward_tape_->executor_ = executor_;
+
+  // Recomputed segments are not part of the fingerprint
+  std::string key;
+  if (FLAGS_tape_cache_backward && segments_.empty()) {
+    key = BackwardFingerprint(tape_, target.get());
+  }
+  std::shared_ptr<const BackwardTemplate> cached =
+      key.empty() ? nullptr : BackwardCache::Instance().Lookup(key);
+  if (cached != nullptr) {
+    cached->Instantiate(tape_, &backward_tape_->tape_);
+  } else {
+    BuildBackward(target);
+    if (!key.empty()) {
+      BackwardCache::Instance().Insert(
+          key, BackwardTemplate(tape_, backward_tape_->tape_));
+    }
+  }
 
+  ScheduleRelease(
+      tape_, current_position_, target.get(), &backward_tape_->tape_);
+
+  backward_tape_->Forward();
+  has_been_backwarded_ = true;
+}
+
+void Tape::BuildBackward(VariableHandle target) {
   framework::AttributeMap attrs;
 
   // FIXME(tonyyang-svail): Need to infer_data_type
   attrs["dtype"] = framework::proto::VarType::Type::VarType_Type_FP32;
   attrs["shape"] = std::vector<int>{1};
   attrs["value"] = 1.0f;
-  backward_tape_->AddOp(
-      "fill_constant", {}, {{"Out", {target->Grad()}}}, attrs);
+  VariableHandle target_grad = target->Grad();
+  backward_tape_->RecordOp(
+      "fill_constant", {}, {{"Out", {target_grad}}}, attrs);
+
+  // Gradients that have been written by an op on backward_tape_
+  std::unordered_set<Variable *> written_grads{target_grad.get()};
+
+  std::unordered_set<Variable *> requires_grad;
+  std::vector<bool> differentiate =
+      OpsToDifferentiate(tape_, target.get(), &requires_grad);
+
+  // Checkpointed segments are recomputed right before their first grad op
+  std::vector<bool> recomputed(segments_.size(), false);
+
+  // Scratch Variables the extra contributors of every gradient are written
+  // to. They are reused by all the contributors, so that their storage is
+  // allocated once, and released after their last sum.
+  std::unordered_map<Variable *, std::vector<VariableHandle>> scratch;
+  std::unordered_map<Variable *, size_t> last_sum;
 
   for (auto it = tape_.rbegin(); it != tape_.rend(); ++it) {
+    size_t position = tape_.rend() - it - 1;
+    if (!differentiate[position]) continue;
+
+    for (size_t i = 0; i < segments_.size(); ++i) {
+      auto &segment = segments_[i];
+      if (recomputed[i] || position < segment.begin ||
+          position >= segment.end) {
+        continue;
+      }
+      for (size_t recompute : segment.recompute) {
+        backward_tape_->tape_.push_back(tape_[recompute].Clone());
+      }
+      recomputed[i] = true;
+    }
+
     framework::OpDesc op_desc =
-        CreateOpDesc(it->type_, it->inputs_, it->outputs_, it->attrs_);
+        CreateOpDesc(it->type_, RecordedInputs(*it), it->outputs_, it->attrs_);
     std::unordered_map<std::string, std::string> grad_to_var;
     std::vector<std::unique_ptr<framework::OpDesc>> grad_op_descs =
         framework::OpInfoMap::Instance()
             .Get(op_desc.Type())
             .GradOpMaker()(op_desc, {}, &grad_to_var, {});
 
-    for (auto &op_desc : grad_op_descs) {
-      std::unordered_map<std::string, VariableHandle> name2var;
-      for (auto &param2vars : it->inputs_) {
-        for (auto &a : param2vars.second) {
-          name2var[a->Name()] = a;
+    std::unordered_map<std::string, VariableHandle> name2var;
+    // Inputs overwritten in place since the op was recorded
+    std::unordered_set<std::string> clobbered;
+    size_t k = 0;
+    for (auto &param2vars : it->inputs_) {
+      for (auto &a : param2vars.second) {
+        uint64_t version = it->input_versions_[k++];
+        if (param2vars.first == kCseSource) continue;
+        name2var[a->Name()] = a;
+        if (a->Version() != version) {
+          clobbered.insert(a->Name());
         }
       }
-      for (auto &param2vars : it->outputs_) {
-        for (auto &a : param2vars.second) {
-          name2var[a->Name()] = a;
+    }
+    for (auto &param2vars : it->outputs_) {
+      for (auto &a : param2vars.second) {
+        name2var[a->Name()] = a;
+      }
+    }
+
+    for (auto &op_desc : grad_op_descs) {
+      // Forward Variable of a gradient argument
+      auto forward_var = [&name2var](const std::string &argu) {
+        PADDLE_ENFORCE(ends_with(argu, framework::kGradVarSuffix),
+                       argu.c_str());
+        std::string name = argu.substr(
+            0, argu.size() - std::strlen(framework::kGradVarSuffix));
+        PADDLE_ENFORCE(name2var.count(name), name.c_str());
+        return name2var[name];
+      };
+
+      // A gradient nobody requires is not computed. The arguments of a
+      // duplicable parameter are positional, so they are kept or dropped
+      // together.
+      std::map<std::string, bool> required_outputs;
+      bool has_required_output = false;
+      for (auto &p2a : op_desc->Outputs()) {
+        bool &required = required_outputs[p2a.first];
+        for (auto &argu : p2a.second) {
+          required = required || name2var.count(argu) ||
+                     requires_grad.count(forward_var(argu).get());
         }
+        has_required_output = has_required_output || required;
       }
+      if (!has_required_output) continue;
 
       VariableHandleMap in_vars;
+      for (auto &p2a : op_desc->Inputs()) {
+        for (auto &argu : p2a.second) {
+          if (name2var.count(argu)) {
+            PADDLE_ENFORCE(!clobbered.count(argu),
+                           "%s is needed by %s but has been overwritten in "
+                           "place",
+                           argu,
+                           op_desc->Type());
+            in_vars[p2a.first].push_back(name2var[argu]);
+            continue;
+          }
+          VariableHandle var = forward_var(argu);
+          VariableHandle grad = var->Grad();
+          if (!written_grads.count(grad.get())) {
+            // Nothing contributes to this gradient, so it is zero
+            backward_tape_->RecordOp(
+                "fill_zeros_like", {{"X", {var}}}, {{"Out", {grad}}}, {});
+            written_grads.insert(grad.get());
+          }
+          in_vars[p2a.first].push_back(grad);
+        }
+      }
+
+      // A gradient that already has a contributor is written to a scratch
+      // Variable first, which is then summed into the gradient in place.
+      std::vector<std::pair<VariableHandle, VariableHandle>> accumulations;
+      // Scratch Variables of every gradient taken by this grad op
+      std::unordered_map<Variable *, size_t> taken;
       VariableHandleMap out_vars;
-      std::map<const framework::VariableNameMap *, VariableHandleMap *>
-          loop_over{{&op_desc->Inputs(), &in_vars},
-                    {&op_desc->Outputs(), &out_vars}};
-      for (auto &each : loop_over) {
-        auto &vmp = *each.first;
-        auto &vhm = *each.second;
-        for (auto &p2a : vmp) {
-          for (auto &argu : p2a.second) {
-            if (name2var.count(argu)) {
-              vhm[p2a.first].push_back(name2var[argu]);
-            } else {
-              PADDLE_ENFORCE(ends_with(argu, framework::kGradVarSuffix),
-                             argu.c_str());
-              std::string name = argu.substr(
-                  0, argu.size() - std::strlen(framework::kGradVarSuffix));
-              PADDLE_ENFORCE(name2var.count(name), name.c_str());
-              vhm[p2a.first].push_back(name2var[name]->Grad());
+      for (auto &p2a : required_outputs) {
+        auto &vars = out_vars[p2a.first];
+        if (!p2a.second) continue;
+        for (auto &argu : op_desc->Output(p2a.first)) {
+          if (name2var.count(argu)) {
+            vars.push_back(name2var[argu]);
+            continue;
+          }
+          VariableHandle grad = forward_var(argu)->Grad();
+          if (written_grads.count(grad.get())) {
+            auto &pool = scratch[grad.get()];
+            size_t k = taken[grad.get()]++;
+            if (k == pool.size()) {
+              pool.emplace_back(new Variable(grad->Name() + "@RENAME@"));
             }
+            accumulations.emplace_back(grad, pool[k]);
+            vars.push_back(pool[k]);
+          } else {
+            written_grads.insert(grad.get());
+            vars.push_back(grad);
           }
         }
       }
 
-      backward_tape_->AddOp(
-          op_desc->Type(), in_vars, out_vars, op_desc->GetAttrMap());
+      backward_tape_->RecordOp(op_desc->Type(),
+                               std::move(in_vars),
+                               std::move(out_vars),
+                               op_desc->GetAttrMap());
+
+      for (auto &grad2temp : accumulations) {
+        // sum_op runs in place when Out is the same Variable as X[0]
+        backward_tape_->RecordOp("sum",
+                                 {{"X", {grad2temp.first, grad2temp.second}}},
+                                 {{"Out", {grad2temp.first}}},
+                                 {});
+        last_sum[grad2temp.second.get()] = backward_tape_->tape_.size() - 1;
+      }
     }
+  }
 
-    // TODO(tonyyang-svail): how to fill empty grad?
-    // TODO(tonyyang-svail): Sum var grad is necessary
+  for (auto &var2position : last_sum) {
+    backward_tape_->tape_[var2position.second].release_after_run_.push_back(
+        var2position.first);
   }
+}
 
-  backward_tape_->Forward();
-  has_been_backwarded_ = true;
+void Tape::EnableCheckpointing(size_t segment_size) {
+  PADDLE_ENFORCE(!async_, "Async mode does not support checkpointing");
+  checkpointing_ = true;
+  segment_size_ = segment_size;
+}
+
+void Tape::MarkCheckpoint() {
+  PADDLE_ENFORCE(!async_, "Async mode does not support checkpointing");
+  checkpointing_ = true;
+  checkpoints_.insert(tape_.size());
+}
+
+bool Tape::IsSegmentEnd(size_t end) const {
+  if (!checkpoints_.empty()) {
+    return checkpoints_.count(end) > 0;
+  }
+  size_t begin = segments_.empty() ? 0 : segments_.back().end;
+  size_t segment_size = segment_size_;
+  if (segment_size == 0) {
+    segment_size = static_cast<size_t>(std::ceil(std::sqrt(tape_.size())));
+  }
+  return end - begin >= segment_size;
+}
+
+void Tape::EndSegment(size_t end) {
+  Segment segment{segments_.empty() ? 0 : segments_.back().end, end, {}};
+
+  std::unordered_map<Variable *, int64_t> tape_refs;
+  std::unordered_set<Variable *> used_later;
+  for (size_t i = 0; i < tape_.size(); ++i) {
+    for (auto &param2var : tape_[i].inputs_) {
+      for (auto &var : param2var.second) {
+        tape_refs[var.get()]++;
+        if (i >= end) used_later.insert(var.get());
+      }
+    }
+    for (auto &param2var : tape_[i].outputs_) {
+      for (auto &var : param2var.second) {
+        tape_refs[var.get()]++;
+      }
+    }
+  }
+
+  for (size_t i = segment.begin; i < end; ++i) {
+    bool released = false;
+    for (auto &param2var : tape_[i].outputs_) {
+      for (auto &var : param2var.second) {
+        // Recomputing an op that overwrites its own input is not idempotent
+        bool overwrites_input = false;
+        for (auto &in2var : tape_[i].inputs_) {
+          for (auto &input : in2var.second) {
+            overwrites_input = overwrites_input || input == var;
+          }
+        }
+        if (overwrites_input || used_later.count(var.get()) ||
+            var.use_count() > tape_refs[var.get()]) {
+          continue;
+        }
+        var->MutableVar()->Clear();
+        released = true;
+      }
+    }
+    if (released) {
+      segment.recompute.push_back(i);
+    }
+  }
+  VLOG(3) << "Checkpoint segment [" << segment.begin << ", " << end
+          << "), recompute " << segment.recompute.size() << " ops";
+  segments_.push_back(std::move(segment));
+}
+
+void Tape::Freeze() {
+  frozen_ = true;
+  if (backward_tape_) {
+    backward_tape_->frozen_ = true;
+  }
+
+  // The plan assumes the ops run in the order of the tape
+  if (FLAGS_tape_plan_memory && !checkpointing_ && executor_ == nullptr &&
+      async_ == nullptr) {
+    PlanMemoryOfTapes();
+  }
+
+  // Replay() runs each tape as one range, unless it is split into segments
+  // which are planned by the first Replay()
+  if (checkpointing_) return;
+  for (auto *tape : {this, backward_tape_.get()}) {
+    if (tape != nullptr && !tape->tape_.empty()) {
+      tape->PlanRange(0, tape->tape_.size());
+    }
+  }
+}
+
+void Tape::PlanMemoryOfTapes() {
+  memory_plan_ = std::make_shared<MemoryPlan>(PlanMemory(
+      &tape_, backward_tape_ ? &backward_tape_->tape_ : nullptr));
+  memory_plan_->Bind();
+  memory_planned_ = true;
+  if (backward_tape_) {
+    backward_tape_->memory_planned_ = true;
+  }
+
+  // Ops run in place by an earlier Forward() will read their input again
+  for (auto *tape : {this, backward_tape_.get()}) {
+    if (tape == nullptr) continue;
+    for (auto &op : tape->tape_) {
+      size_t k = 0;
+      for (auto &param2var : op.inputs_) {
+        for (auto &var : param2var.second) {
+          op.input_versions_[k++] = var->Version();
+        }
+      }
+    }
+  }
+}
+
+size_t Tape::PlannedMemoryBytes() const {
+  return memory_plan_ ? memory_plan_->Bytes() : 0;
+}
+
+void Tape::Replay() {
+  PADDLE_ENFORCE(frozen_, "Only a frozen tape can be replayed");
+  if (async_) {
+    // A replay runs on the calling thread
+    async_->WaitAll();
+  }
+  current_position_ = 0;
+  for (auto &op : tape_) {
+    op.run_ahead_ = false;
+  }
+  segments_.clear();
+  has_been_backwarded_ = false;
+  RunForward();
+  if (backward_tape_) {
+    backward_tape_->current_position_ = 0;
+    backward_tape_->Forward();
+    has_been_backwarded_ = true;
+  }
+}
+
+void Tape::Feed(VariableHandle placeholder, const framework::LoDTensor &data) {
+  for (auto &op : tape_) {
+    for (auto &param2var : op.outputs_) {
+      for (auto &var : param2var.second) {
+        PADDLE_ENFORCE(var != placeholder,
+                       "%s is written by %s and is not a placeholder",
+                       placeholder->Name(),
+                       op.type_);
+      }
+    }
+  }
+
+  framework::VarDesc *desc = placeholder->MutableDesc();
+  if (desc->GetShape().empty()) {
+    PADDLE_ENFORCE(!frozen_, "Can not feed an unrecorded placeholder");
+    desc->SetType(framework::proto::VarType::LOD_TENSOR);
+    desc->SetDataType(framework::ToDataType(data.type()));
+    desc->SetShape(framework::vectorize(data.dims()));
+  } else {
+    PADDLE_ENFORCE(framework::make_ddim(desc->GetShape()) == data.dims(),
+                   "%s is recorded as [%s], but fed with [%s]",
+                   placeholder->Name(),
+                   framework::make_ddim(desc->GetShape()),
+                   data.dims());
+    PADDLE_ENFORCE(desc->GetDataType() == framework::ToDataType(data.type()),
+                   "%s is fed with a different data type",
+                   placeholder->Name());
+  }
+
+  if (async_) {
+    // Ops still reading the previous data
+    WaitForUses(placeholder.get());
+  }
+  auto *tensor = placeholder->MutableVar()->GetMutable<framework::LoDTensor>();
+  tensor->ShareDataWith(data);
+  tensor->set_lod(data.lod());
+  placeholder->SetSharesConstant(false);
 }
 
-Tape &get_global_tape() {
-  static Tape T;
-  return T;
+// Version of the format written by Tape::Save()
+constexpr uint32_t kTapeFileVersion = 0;
+// Attribute of a saved op listing its release_after_run_
+constexpr char kReleaseAttr[] = "tape_release_after_run";
+
+void WriteString(std::ostream &os, const std::string &str) {
+  uint64_t size = str.size();
+  os.write(reinterpret_cast<const char *>(&size), sizeof(size));
+  os.write(str.data(), size);
 }
 
+std::string ReadString(std::istream &is) {
+  uint64_t size;
+  is.read(reinterpret_cast<char *>(&size), sizeof(size));
+  std::string str(size, '\0');
+  is.read(&str[0], size);
+  PADDLE_ENFORCE(is.good(), "Truncated tape file");
+  return str;
+}
+
+void Tape::Save(std::ostream &os,
+                const std::map<std::string, VariableHandle> &bindings) const {
+  framework::ProgramDesc program;
+  framework::BlockDesc *global = program.MutableBlock(0);
+
+  // Every Variable is saved once in the global block, under its name
+  std::unordered_map<std::string, const Variable *> saved;
+  std::unordered_set<const Variable *> written;
+  auto save_var = [&saved, global](const VariableHandle &var) {
+    auto inserted = saved.emplace(var->Name(), var.get());
+    PADDLE_ENFORCE(inserted.first->second == var.get(),
+                   "More than one Variable is named %s",
+                   var->Name());
+    if (inserted.second) {
+      *global->Var(var->Name())->Proto() = *var->MutableDesc()->Proto();
+    }
+  };
+  auto save_ops = [&](const OpHandleList &ops, framework::BlockDesc *block) {
+    for (auto &op : ops) {
+      for (auto &param2var : op.inputs_) {
+        for (auto &var : param2var.second) save_var(var);
+      }
+      for (auto &param2var : op.outputs_) {
+        for (auto &var : param2var.second) {
+          save_var(var);
+          written.insert(var.get());
+        }
+      }
+
+      framework::OpDesc *desc = block->AppendOp();
+      desc->CopyFrom(
+          CreateOpDesc(op.type_, op.inputs_, op.outputs_, op.attrs_));
+      // A Variable no op refers to is not part of the saved tapes
+      std::vector<std::string> releases;
+      for (auto *var : op.release_after_run_) {
+        if (saved.count(var->Name())) releases.push_back(var->Name());
+      }
+      if (!releases.empty()) {
+        desc->SetAttr(kReleaseAttr, releases);
+      }
+    }
+  };
+  save_ops(tape_, global);
+  if (backward_tape_) {
+    save_ops(backward_tape_->tape_, program.AppendBlock(*global));
+  }
+
+  os.write(reinterpret_cast<const char *>(&kTapeFileVersion),
+           sizeof(kTapeFileVersion));
+  WriteString(os, program.Proto()->SerializeAsString());
+
+  // The data of the bound Variables that no op writes, e.g. parameters
+  auto &dev_ctx =
+      *platform::DeviceContextPool::Instance().Get(platform::CPUPlace());
+  uint64_t size = bindings.size();
+  os.write(reinterpret_cast<const char *>(&size), sizeof(size));
+  for (auto &key2var : bindings) {
+    const Variable *var = key2var.second.get();
+    PADDLE_ENFORCE(saved.count(var->Name()) && saved[var->Name()] == var,
+                   "%s is bound to %s, which is not used by the tape",
+                   key2var.first,
+                   var->Name());
+    WriteString(os, key2var.first);
+    WriteString(os, var->Name());
+    uint8_t has_data = !written.count(var) && var->Var().IsInitialized() &&
+                       var->Var().IsType<framework::LoDTensor>();
+    os.write(reinterpret_cast<const char *>(&has_data), sizeof(has_data));
+    if (has_data) {
+      framework::SerializeToStream(
+          os, var->Var().Get<framework::LoDTensor>(), dev_ctx);
+    }
+  }
+}
+
+Tape Tape::Load(std::istream &is,
+                std::map<std::string, VariableHandle> *bindings) {
+  uint32_t version;
+  is.read(reinterpret_cast<char *>(&version), sizeof(version));
+  PADDLE_ENFORCE(is.good() && version == kTapeFileVersion,
+                 "Unsupported tape file version %d",
+                 version);
+  framework::ProgramDesc program(ReadString(is));
+  const framework::BlockDesc &global = program.Block(0);
+
+  // New Variables named after the saved ones, so that they do not collide
+  // with the Variables of this process. A gradient is created by Grad() of
+  // its Variable.
+  std::unordered_map<std::string, VariableHandle> vars;
+  auto load_desc = [&vars](framework::VarDesc *desc, VariableHandle var) {
+    std::string name = var->Name();
+    *var->MutableDesc()->Proto() = *desc->Proto();
+    var->MutableDesc()->SetName(name);
+    vars[desc->Name()] = var;
+  };
+  std::vector<framework::VarDesc *> grads;
+  for (auto *desc : global.AllVars()) {
+    const std::string &name = desc->Name();
+    if (ends_with(name, framework::kGradVarSuffix)) {
+      grads.push_back(desc);
+      continue;
+    }
+    load_desc(desc,
+              VariableHandle(new Variable(
+                  name.substr(0, name.find_last_not_of("0123456789") + 1))));
+  }
+  for (auto *desc : grads) {
+    std::string name = desc->Name().substr(
+        0, desc->Name().size() - std::strlen(framework::kGradVarSuffix));
+    auto it = vars.find(name);
+    load_desc(desc,
+              it != vars.end() ? it->second->Grad()
+                               : VariableHandle(new Variable(name, true)));
+  }
+
+  auto load_ops = [&vars](const framework::BlockDesc &block,
+                          OpHandleList *ops) {
+    auto args = [&vars](const framework::VariableNameMap &names) {
+      VariableHandleMap result;
+      for (auto &param2names : names) {
+        auto &list = result[param2names.first];
+        for (auto &name : param2names.second) {
+          list.push_back(vars.at(name));
+        }
+      }
+      return result;
+    };
+    for (auto *desc : block.AllOps()) {
+      framework::AttributeMap attrs = desc->GetAttrMap();
+      attrs.erase(kReleaseAttr);
+      ops->emplace_back(desc->Type(),
+                        args(desc->Inputs()),
+                        args(desc->Outputs()),
+                        std::move(attrs));
+      OpHandle &op = ops->back();
+      if (desc->HasAttr(kReleaseAttr)) {
+        for (auto &name : boost::get<std::vector<std::string>>(
+                 desc->GetAttr(kReleaseAttr))) {
+          op.release_after_run_.push_back(vars.at(name).get());
+        }
+      }
+      for (auto &param2var : op.inputs_) {
+        for (auto &var : param2var.second) {
+          op.input_versions_.push_back(var->Version());
+        }
+      }
+    }
+  };
+
+  Tape tape;
+  load_ops(global, &tape.tape_);
+  if (program.Size() > 1) {
+    tape.backward_tape_.reset(new Tape());
+    tape.backward_tape_->name_ = "backward";
+    load_ops(program.Block(1), &tape.backward_tape_->tape_);
+  }
+
+  auto &dev_ctx =
+      *platform::DeviceContextPool::Instance().Get(platform::CPUPlace());
+  uint64_t size;
+  is.read(reinterpret_cast<char *>(&size), sizeof(size));
+  for (uint64_t i = 0; i < size; ++i) {
+    std::string key = ReadString(is);
+    VariableHandle var = vars.at(ReadString(is));
+    uint8_t has_data;
+    is.read(reinterpret_cast<char *>(&has_data), sizeof(has_data));
+    if (has_data) {
+      framework::DeserializeFromStream(
+          is, var->MutableVar()->GetMutable<framework::LoDTensor>(), dev_ctx);
+    }
+    (*bindings)[key] = var;
+  }
+  PADDLE_ENFORCE(is.good(), "Truncated tape file");
+
+  // Only the tapes and the bindings hold the Variables when planning memory
+  vars.clear();
+  tape.Freeze();
+  return tape;
+}
+
+namespace {
+
+Tape *&CurrentTape() {
+  thread_local Tape default_tape;
+  thread_local Tape *current = &default_tape;
+  return current;
+}
+
+bool &GradEnabled() {
+  thread_local bool enabled = true;
+  return enabled;
+}
+
+}  // namespace
+
+Tape &get_global_tape() { return *CurrentTape(); }
+
 void reset_global_tape() { get_global_tape() = Tape(); }
+
+TapeGuard::TapeGuard(Tape *tape) : previous_(CurrentTape()) {
+  PADDLE_ENFORCE_NOT_NULL(tape);
+  CurrentTape() = tape;
+}
+
+TapeGuard::~TapeGuard() { CurrentTape() = previous_; }
+
+NoGradGuard::NoGradGuard() : previous_(GradEnabled()) {
+  GradEnabled() = false;
+}
+
+NoGradGuard::~NoGradGuard() { GradEnabled() = previous_; }
+
+bool IsGradEnabled() { return GradEnabled(); }
 }  // namespace tape
 }  // namespace paddle
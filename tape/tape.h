@@ -13,52 +13,296 @@
 // limitations under the License.
 #pragma once
 
+#include <deque>
+#include <istream>
 #include <map>
 #include <memory>
+#include <ostream>
+#include <set>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
+#include "paddle/fluid/framework/lod_tensor.h"
+#include "paddle/fluid/framework/op_desc.h"
+#include "src/executor.h"
+#include "src/op_cache.h"
 #include "src/variable.h"
 
 namespace paddle {
 namespace tape {
 
-using VariableHandleMap = std::map<std::string, std::vector<VariableHandle>>;
-
+// Move-only, the arguments are moved in from Tape::AddOp
 struct OpHandle {
   OpHandle(const std::string &type,
-           const VariableHandleMap &in_vars,
-           const VariableHandleMap &out_vars,
-           const framework::AttributeMap &attrs)
-      : type_(type), inputs_(in_vars), outputs_(out_vars), attrs_(attrs) {}
+           VariableHandleMap in_vars,
+           VariableHandleMap out_vars,
+           framework::AttributeMap attrs)
+      : type_(type),
+        inputs_(std::move(in_vars)),
+        outputs_(std::move(out_vars)),
+        attrs_(std::move(attrs)) {}
+
+  OpHandle(OpHandle &&) = default;
+  OpHandle &operator=(OpHandle &&) = default;
+  OpHandle(const OpHandle &) = delete;
+  OpHandle &operator=(const OpHandle &) = delete;
+
+  // Explicit copy, for running the op once more on another tape
+  OpHandle Clone() const {
+    OpHandle op(type_, inputs_, outputs_, attrs_);
+    op.cached_op_ = cached_op_;
+    op.flat_vars_ = flat_vars_;
+    op.release_after_run_ = release_after_run_;
+    op.input_versions_ = input_versions_;
+    return op;
+  }
 
   std::string type_;
   VariableHandleMap inputs_;
   VariableHandleMap outputs_;
   framework::AttributeMap attrs_;
+
+  // Not own, resolved from OperatorCache on the first Forward()
+  CachedOperator *cached_op_ = nullptr;
+  // Variables of inputs_ and outputs_ in the slot order of cached_op_
+  std::vector<framework::Variable *> flat_vars_;
+
+  // Variables whose storage is released once the op has been run
+  std::vector<Variable *> release_after_run_;
+
+  // Version of every input when the op was recorded, in the order of inputs_
+  std::vector<uint64_t> input_versions_;
+
+  // Run by Tape::Evaluate() while earlier ops were still pending
+  bool run_ahead_ = false;
 };
 
+// Elements keep their address when ops are appended
+using OpHandleList = std::deque<OpHandle>;
+
+// OpDesc of an op, its arguments are named after the Variables
+framework::OpDesc CreateOpDesc(const std::string &type,
+                               const VariableHandleMap &in_vars,
+                               const VariableHandleMap &out_vars,
+                               const framework::AttributeMap &attrs);
+
+struct MemoryPlan;
+
 class Tape {
  public:
+  Tape() = default;
+  ~Tape();
+  Tape(Tape &&) = default;
+  Tape &operator=(Tape &&) = default;
+
+  // Pass temporaries or std::move the maps, they are moved into the tape.
+  // Under a NoGradGuard the op is run right away and not recorded.
   void AddOp(const std::string &type,
-             const VariableHandleMap &in_vars,
+             VariableHandleMap in_vars,
              VariableHandleMap out_vars,
-             const framework::AttributeMap &attrs);
+             framework::AttributeMap attrs);
   void Forward();
   void Backward(VariableHandle target);
 
   bool HasBeenBackwarded() { return has_been_backwarded_; }
 
+  // Record-once / replay-many for static-shape tapes.
+  //
+  // Freeze() turns the recorded tape, and its backward tape if Backward()
+  // has been called, into a reusable plan: no op can be added afterwards,
+  // nor can Backward() be called.
+  // Replay() re-executes the plan against the data currently held by the
+  // Variables, without any shape inference or grad op construction. The
+  // fusion, in-place and parallel execution plans, and the common
+  // subexpressions, are found once by Freeze() and reused by every Replay().
+  //
+  // Unless FLAGS_tape_plan_memory is off, Freeze() also plans the memory of
+  // the intermediates, see memory_planner.h. A tape with checkpointing, an
+  // execution strategy or async mode is not planned, and the ops of a
+  // planned tape do not run in place.
+  void Freeze();
+  void Replay();
+  bool IsFrozen() const { return frozen_; }
+  // Bytes of the arenas of the memory plan, 0 if there is none
+  size_t PlannedMemoryBytes() const;
+
+  // Bind data to a placeholder, i.e. a Variable that is not written by any
+  // op on the tape. An empty placeholder takes the shape and data type of
+  // the data; once frozen, the data must match the recorded shape.
+  void Feed(VariableHandle placeholder, const framework::LoDTensor &data);
+
+  // Execution plan files, for starting without recording the tape again.
+  //
+  // Save() writes the ops of the tape and of its backward tape, with their
+  // attributes and inferred VarDescs, as the two blocks of a ProgramDesc,
+  // followed by bindings: a key for each of the Variables the loader will
+  // need, like the placeholders, the parameters and the loss. The data of
+  // a bound Variable that no op writes is saved as well.
+  //
+  // Load() restores a frozen tape ready for Replay(), without shape
+  // inference or grad op construction, and fills bindings with the new
+  // Variables under the keys they were saved with.
+  void Save(std::ostream &os,
+            const std::map<std::string, VariableHandle> &bindings) const;
+  static Tape Load(std::istream &is,
+                   std::map<std::string, VariableHandle> *bindings);
+
+  // Gradient checkpointing, which trades one extra forward for memory.
+  //
+  // The tape is split into segments. Forward() releases the activations
+  // that are used only inside their segment, and Backward() recomputes a
+  // segment right before its grad ops. A segment ends at every
+  // MarkCheckpoint(), or, if none is marked, every segment_size ops. The
+  // default segment_size 0 means sqrt(N) for a tape of N ops.
+  void EnableCheckpointing(size_t segment_size = 0);
+  void MarkCheckpoint();
+
+  // Run independent ops of Forward() and of the backward tape concurrently.
+  // Ops are ordered by the Variables they read, write and release, so the
+  // result is the same as running the tape in order.
+  void SetExecutionStrategy(const ExecutionStrategy &strategy);
+
+  // Asynchronous execution, enabled on an empty tape.
+  //
+  // AddOp() hands every op to a background thread that runs the ops in
+  // order, so the graph can be built further while they run. An op that
+  // writes a Variable first waits for the earlier ops using it. Forward()
+  // waits for all the ops, Evaluate() only for the producer of a Variable.
+  // Fusion, checkpointing and the execution strategy do not apply to the
+  // ops run asynchronously; Backward() runs the backward tape as usual.
+  void EnableAsync();
+  bool IsAsync() const { return async_ != nullptr; }
+
+  // Make the value of var available: wait for its producer in async mode,
+  // otherwise run only the pending ops var depends on. The other ops stay
+  // pending for Forward(), and those that neither an Evaluate() nor the
+  // target of Backward() depends on are never run. With checkpointing the
+  // whole tape is run by Forward().
+  void Evaluate(const Variable *var);
+
  private:
+  struct Segment {
+    size_t begin;
+    size_t end;
+    // Ops in [begin, end) whose outputs have been released
+    std::vector<size_t> recompute;
+  };
+
+  // Append the grad ops of the ops leading to target to backward_tape_
+  void BuildBackward(VariableHandle target);
+
+  bool IsSegmentEnd(size_t end) const;
+  void EndSegment(size_t end);
+
+  // Run tape_[begin, end) sequentially or on executor_
+  void RunOps(size_t begin, size_t end);
+  // CSE, fusion, in-place and executor plans of tape_[begin, end), made once
+  // per range on a frozen tape
+  struct RangePlan;
+  std::shared_ptr<const RangePlan> PlanRange(size_t begin, size_t end);
+  // Freeze() with a MemoryPlan of tape_ and backward_tape_
+  void PlanMemoryOfTapes();
+  // Run the ops from current_position_ on the calling thread
+  void RunForward();
+  // Run the pending ops needed before reads can be read and writes written,
+  // and only those
+  void RunAhead(std::unordered_set<const Variable *> reads,
+                std::unordered_set<const Variable *> writes);
+  // AddOp() with gradients enabled, also used by Backward() whether or not
+  // a NoGradGuard is alive
+  void RecordOp(const std::string &type,
+                VariableHandleMap in_vars,
+                VariableHandleMap out_vars,
+                framework::AttributeMap attrs);
+  // AddOp() under a NoGradGuard
+  void RunNoGrad(const std::string &type,
+                 VariableHandleMap in_vars,
+                 VariableHandleMap out_vars,
+                 framework::AttributeMap attrs);
+  // Hand tape_.back() to async_
+  void SubmitAsync();
+  // Wait for the async ops that read or write var
+  void WaitForUses(const Variable *var);
+
+  // First, so that the worker is stopped before any op is replaced or
+  // destroyed when the tape is assigned to
+  std::unique_ptr<AsyncExecutor> async_;
+  // Number of the last async task writing, or using, a Variable
+  std::unordered_map<const Variable *, size_t> last_write_task_;
+  std::unordered_map<const Variable *, size_t> last_use_task_;
+
+  // Prefix of the profiler events of the ops
+  std::string name_ = "forward";
+
   bool has_been_backwarded_ = false;
+  bool frozen_ = false;
   size_t current_position_ = 0;
 
-  std::vector<OpHandle> tape_;
+  bool checkpointing_ = false;
+  size_t segment_size_ = 0;
+  std::set<size_t> checkpoints_;
+  std::vector<Segment> segments_;
+
+  // Shared with backward_tape_, nullptr runs the ops in order
+  std::shared_ptr<ParallelExecutor> executor_;
+
+  // Set by Freeze() on the forward tape, the backward tape is only marked
+  std::shared_ptr<MemoryPlan> memory_plan_;
+  bool memory_planned_ = false;
+  // The plans of a frozen tape reused by every Replay(), by range
+  std::map<std::pair<size_t, size_t>, std::shared_ptr<const RangePlan>>
+      range_plans_;
+
+  OpHandleList tape_;
   std::shared_ptr<Tape> backward_tape_;
 };
 
+// The tape the calling thread records ops on. Each thread starts with a tape
+// of its own, so threads building graphs concurrently do not share a tape.
 Tape &get_global_tape();
 
+// Replace the tape returned by get_global_tape() with an empty one
 void reset_global_tape();
+
+/*
+ * Makes tape the one returned by get_global_tape() on the calling thread
+ * until the guard is destroyed, then restores the previous one. Guards can
+ * be nested.
+ */
+class TapeGuard {
+ public:
+  explicit TapeGuard(Tape *tape);
+  ~TapeGuard();
+
+  TapeGuard(const TapeGuard &) = delete;
+  TapeGuard &operator=(const TapeGuard &) = delete;
+
+ private:
+  Tape *previous_;
+};
+
+// Inference mode of the calling thread.
+//
+// While a NoGradGuard is alive, Tape::AddOp() runs every op right away
+// instead of recording it. Neither the op nor its Variables are retained,
+// so an intermediate is freed as soon as the caller drops it, and
+// Backward() does not see the ops.
+class NoGradGuard {
+ public:
+  NoGradGuard();
+  ~NoGradGuard();
+
+  NoGradGuard(const NoGradGuard &) = delete;
+  NoGradGuard &operator=(const NoGradGuard &) = delete;
+
+ private:
+  bool previous_;
+};
+
+// False while a NoGradGuard is alive on the calling thread
+bool IsGradEnabled();
 }  // namespace tape
 }  // namespace paddle
@@ -0,0 +1,205 @@
+// Copyright (c) 2018 PaddlePaddle Authors. All Rights Reserved.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks of the tape engine, e.g.
+//     tape_benchmark --benchmark_filter=BM_Forward \
+//                    --benchmark_out=tape.json --benchmark_out_format=json
+//
+// The cost of Backward() is split between BM_Backward, which constructs and
+// runs the backward tape, and BM_Replay, which runs a frozen forward and
+// backward tape without constructing anything.
+
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "gflags/gflags.h"
+#include "src/function.h"
+
+DECLARE_bool(tape_cache_operators);
+
+using paddle::tape::Fill;
+using paddle::tape::Linear;
+using paddle::tape::Mean;
+using paddle::tape::SGD;
+using paddle::tape::Variable;
+using paddle::tape::VariableHandle;
+using paddle::tape::get_global_tape;
+using paddle::tape::reset_global_tape;
+
+namespace {
+
+paddle::framework::AttributeMap FillAttrs(int batch, int width) {
+  paddle::framework::AttributeMap attrs;
+  attrs["dtype"] = paddle::framework::proto::VarType::Type::VarType_Type_FP32;
+  attrs["shape"] = std::vector<int>{batch, width};
+  attrs["value"] = 1.0f;
+  return attrs;
+}
+
+// depth Linear layers of the same width, fed with a batch of constants
+struct MLP {
+  MLP(int width, int depth, int batch)
+      : filler("fill_constant", FillAttrs(batch, width)) {
+    for (int i = 0; i < depth; ++i) {
+      layers.emplace_back(width, width, "relu");
+    }
+  }
+
+  // Record the loss of a forward pass on a fresh global tape
+  VariableHandle Record() {
+    reset_global_tape();
+    VariableHandle input(new Variable("input"));
+    filler(input);
+    VariableHandle out = input;
+    for (auto &layer : layers) {
+      out = layer(out);
+    }
+    return mean(out);
+  }
+
+  // Number of ops recorded by Record()
+  int64_t NumOps() const { return 3 * layers.size() + 2; }
+
+  std::vector<Linear> layers;
+  Fill filler;
+  Mean mean;
+};
+
+// Arguments are width, depth and batch size
+void Sweep(benchmark::internal::Benchmark *b) {
+  for (int width : {3, 64, 512, 4096}) {
+    for (int depth : {2, 8}) {
+      for (int batch : {1, 32, 256}) {
+        b->Args({width, depth, batch});
+      }
+    }
+  }
+}
+
+// Sweep with and without FLAGS_tape_cache_operators as the last argument
+void SweepCached(benchmark::internal::Benchmark *b) {
+  for (int width : {3, 64, 512, 4096}) {
+    for (int depth : {2, 8}) {
+      for (int batch : {1, 32, 256}) {
+        for (int cached : {0, 1}) {
+          b->Args({width, depth, batch, cached});
+        }
+      }
+    }
+  }
+}
+
+}  // namespace
+
+// Tape::AddOp of a chain of state.range(0) elementwise ops
+void BM_AddOp(benchmark::State &state) {
+  const int64_t num_ops = state.range(0);
+  paddle::framework::AttributeMap attrs = FillAttrs(3, 3);
+  Fill filler("fill_constant", attrs);
+  for (auto _ : state) {
+    state.PauseTiming();
+    reset_global_tape();
+    VariableHandle input(new Variable("input"));
+    filler(input);
+    std::vector<VariableHandle> outs;
+    for (int64_t i = 0; i < num_ops; ++i) {
+      outs.emplace_back(new Variable("out"));
+    }
+    state.ResumeTiming();
+
+    VariableHandle out = input;
+    for (auto &next : outs) {
+      get_global_tape().AddOp("elementwise_add",
+                              {{"X", {out}}, {"Y", {input}}},
+                              {{"Out", {next}}},
+                              {{"axis", -1}});
+      out = next;
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * num_ops);
+}
+BENCHMARK(BM_AddOp)->Arg(100)->Arg(1000)->Arg(10000);
+
+// Tape::Forward of a recorded MLP, items are ops
+void BM_Forward(benchmark::State &state) {
+  FLAGS_tape_cache_operators = state.range(3) != 0;
+  MLP mlp(state.range(0), state.range(1), state.range(2));
+  for (auto _ : state) {
+    state.PauseTiming();
+    mlp.Record();
+    state.ResumeTiming();
+
+    get_global_tape().Forward();
+  }
+  state.SetItemsProcessed(state.iterations() * mlp.NumOps());
+  FLAGS_tape_cache_operators = true;
+}
+BENCHMARK(BM_Forward)->Apply(SweepCached)->Unit(benchmark::kMicrosecond);
+
+// Tape::Backward after Forward, i.e. building and running the backward tape
+void BM_Backward(benchmark::State &state) {
+  MLP mlp(state.range(0), state.range(1), state.range(2));
+  for (auto _ : state) {
+    state.PauseTiming();
+    VariableHandle loss = mlp.Record();
+    get_global_tape().Forward();
+    state.ResumeTiming();
+
+    get_global_tape().Backward(loss);
+  }
+  state.SetItemsProcessed(state.iterations() * mlp.NumOps());
+}
+BENCHMARK(BM_Backward)->Apply(Sweep)->Unit(benchmark::kMicrosecond);
+
+// Tape::Replay of a frozen forward and backward tape
+void BM_Replay(benchmark::State &state) {
+  MLP mlp(state.range(0), state.range(1), state.range(2));
+  VariableHandle loss = mlp.Record();
+  get_global_tape().Backward(loss);
+  get_global_tape().Freeze();
+  for (auto _ : state) {
+    get_global_tape().Replay();
+  }
+  state.SetItemsProcessed(state.iterations() * mlp.NumOps());
+}
+BENCHMARK(BM_Replay)->Apply(Sweep)->Unit(benchmark::kMicrosecond);
+
+// A full training step: record, forward, backward and SGD, items are samples
+void BM_MLPStep(benchmark::State &state) {
+  MLP mlp(state.range(0), state.range(1), state.range(2));
+  SGD sgd(0.001);
+  for (auto _ : state) {
+    VariableHandle loss = mlp.Record();
+    get_global_tape().Backward(loss);
+    for (auto &layer : mlp.layers) {
+      for (auto &w : layer.Params()) {
+        sgd.Update(w);
+      }
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(2));
+}
+BENCHMARK(BM_MLPStep)->Apply(Sweep)->Unit(benchmark::kMicrosecond);
+
+int main(int argc, char **argv) {
+  benchmark::Initialize(&argc, argv);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  std::vector<paddle::platform::Place> places;
+  places.emplace_back(paddle::platform::CPUPlace());
+  paddle::platform::DeviceContextPool::Init(places);
+
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -12,8 +12,25 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "gflags/gflags.h"
 #include "gtest/gtest.h"
+#include "src/backward_cache.h"
+#include "src/constant_cache.h"
 #include "src/function.h"
+#include "src/op_cache.h"
+#include "src/optimizer.h"
+#include "src/parameter_store.h"
 
 using paddle::tape::VariableHandle;
 using paddle::tape::Variable;
@@ -24,6 +41,91 @@ using paddle::tape::Fill;
 using paddle::tape::reset_global_tape;
 using paddle::tape::get_global_tape;
 
+DECLARE_bool(tape_fuse_elementwise);
+DECLARE_bool(tape_cache_backward);
+DECLARE_bool(tape_cse);
+DECLARE_int32(tape_infer_shape_cache_capacity);
+DECLARE_int32(tape_constant_cache_capacity);
+DECLARE_int32(tape_backward_cache_capacity);
+
+namespace {
+
+// A new Variable filled with value by a fill_constant on the global tape
+VariableHandle FillInput(std::vector<int> shape = {3, 3}, float value = 1.0f) {
+  paddle::framework::AttributeMap attrs;
+  attrs["dtype"] = paddle::framework::proto::VarType::Type::VarType_Type_FP32;
+  attrs["shape"] = shape;
+  attrs["value"] = value;
+  VariableHandle input(new Variable("input"));
+  Fill("fill_constant", attrs)(input);
+  return input;
+}
+
+// A 3x3 tensor holding 0, 1, ..., 8
+paddle::framework::LoDTensor InputData() {
+  paddle::framework::LoDTensor data;
+  float *ptr = data.mutable_data<float>(paddle::framework::make_ddim({3, 3}),
+                                        paddle::platform::CPUPlace());
+  for (int i = 0; i < 9; ++i) {
+    ptr[i] = static_cast<float>(i);
+  }
+  return data;
+}
+
+std::vector<float> Values(const VariableHandle &var) {
+  auto &tensor = var->Var().Get<paddle::framework::LoDTensor>();
+  return std::vector<float>(tensor.data<float>(),
+                            tensor.data<float>() + tensor.numel());
+}
+
+// Gradients of params, one after the other
+std::vector<float> Grads(const std::vector<VariableHandle> &params) {
+  std::vector<float> grads;
+  for (auto &w : params) {
+    std::vector<float> grad = Values(w->Grad());
+    grads.insert(grads.end(), grad.begin(), grad.end());
+  }
+  return grads;
+}
+
+std::vector<VariableHandle> Params(std::initializer_list<Linear *> layers) {
+  std::vector<VariableHandle> params;
+  for (auto *layer : layers) {
+    for (auto &w : layer->Params()) {
+      params.push_back(w);
+    }
+  }
+  return params;
+}
+
+// step(false) and step(true), e.g. without and with an optimization, must
+// give the same results
+void ExpectSameResults(const std::function<std::vector<float>(bool)> &step,
+                       float abs_error = 1e-5f) {
+  std::vector<float> expected = step(false);
+  std::vector<float> results = step(true);
+  ASSERT_EQ(expected.size(), results.size());
+  for (size_t i = 0; i < results.size(); ++i) {
+    EXPECT_NEAR(expected[i], results[i], abs_error) << "at " << i;
+  }
+}
+
+// ExpectSameResults() with flag off and on, flag is restored afterwards
+void ExpectSameResultsWithFlag(bool *flag,
+                               const std::function<std::vector<float>()> &step,
+                               float abs_error = 1e-5f) {
+  bool saved = *flag;
+  ExpectSameResults(
+      [&](bool enabled) {
+        *flag = enabled;
+        return step();
+      },
+      abs_error);
+  *flag = saved;
+}
+
+}  // namespace
+
 TEST(Tape, TestMLP) {
   LOG(INFO) << "TestMLP";
   Linear linear1(3, 3, "relu");
@@ -59,6 +161,869 @@ TEST(Tape, TestMLP) {
   }
 }
 
+TEST(Tape, TestReplay) {
+  Linear linear1(3, 3, "relu");
+  Linear linear2(3, 3, "relu");
+  Mean mean;
+
+  SGD sgd(0.001);
+
+  paddle::framework::LoDTensor data = InputData();
+  std::vector<VariableHandle> params = Params({&linear1, &linear2});
+  auto results = [&params](const VariableHandle &loss) {
+    std::vector<float> values = Values(loss);
+    std::vector<float> grads = Grads(params);
+    values.insert(values.end(), grads.begin(), grads.end());
+    return values;
+  };
+  // Loss and gradients of a tape recorded from scratch
+  auto record = [&]() {
+    paddle::tape::Tape tape;
+    paddle::tape::TapeGuard guard(&tape);
+    VariableHandle input(new Variable("input"));
+    tape.Feed(input, data);
+    VariableHandle loss = mean(linear2(linear1(input)));
+    tape.Backward(loss);
+    return results(loss);
+  };
+
+  reset_global_tape();
+  VariableHandle input(new Variable("input"));
+  get_global_tape().Feed(input, data);
+  auto loss = mean(linear2(linear1(input)));
+  get_global_tape().Backward(loss);
+  get_global_tape().Freeze();
+  std::vector<float> recorded = results(loss);
+
+  get_global_tape().Replay();
+  EXPECT_EQ(recorded, results(loss));
+
+  for (int i = 0; i < 2; ++i) {
+    for (auto w : params) {
+      sgd.Update(w);
+    }
+    get_global_tape().Feed(input, data);
+    get_global_tape().Replay();
+
+    // Replay sees the updated parameters
+    std::vector<float> replayed = results(loss);
+    std::vector<float> expected = record();
+    EXPECT_NE(recorded, replayed);
+    ASSERT_EQ(expected.size(), replayed.size());
+    for (size_t j = 0; j < expected.size(); ++j) {
+      EXPECT_NEAR(expected[j], replayed[j], 1e-6);
+    }
+  }
+}
+
+TEST(Tape, TestInferShapeCache) {
+  auto &cache = paddle::tape::InferShapeCache::Instance();
+  auto scale = [](const VariableHandle &input) {
+    VariableHandle out(new Variable("out"));
+    get_global_tape().AddOp(
+        "scale", {{"X", {input}}}, {{"Out", {out}}}, {{"scale", 2.0f}});
+    return out;
+  };
+
+  reset_global_tape();
+  VariableHandle first = scale(FillInput({3, 3}));
+  size_t cached = cache.Size();
+
+  // An identical op is a hit
+  VariableHandle hit = scale(FillInput({3, 3}));
+  EXPECT_EQ(cached, cache.Size());
+  EXPECT_EQ(std::vector<int64_t>({3, 3}), hit->Desc().GetShape());
+
+  // Another input shape is a miss, for the fill and for the scale
+  VariableHandle miss = scale(FillInput({2, 5}));
+  EXPECT_EQ(cached + 2, cache.Size());
+  EXPECT_EQ(std::vector<int64_t>({2, 5}), miss->Desc().GetShape());
+
+  get_global_tape().Forward();
+  for (auto &out : {first, hit}) {
+    EXPECT_EQ(paddle::framework::make_ddim({3, 3}),
+              out->Var().Get<paddle::framework::LoDTensor>().dims());
+  }
+  EXPECT_EQ(paddle::framework::make_ddim({2, 5}),
+            miss->Var().Get<paddle::framework::LoDTensor>().dims());
+
+  // Beyond its capacity the least recently used ops are evicted
+  int capacity = FLAGS_tape_infer_shape_cache_capacity;
+  FLAGS_tape_infer_shape_cache_capacity = 1;
+  VariableHandle evicting = scale(FillInput({4, 4}));
+  EXPECT_EQ(1UL, cache.Size());
+  EXPECT_EQ(std::vector<int64_t>({4, 4}), evicting->Desc().GetShape());
+  FLAGS_tape_infer_shape_cache_capacity = capacity;
+}
+
+TEST(Tape, TestGradAccumulation) {
+  paddle::framework::LoDTensor data;
+  float *ptr = data.mutable_data<float>(paddle::framework::make_ddim({3, 3}),
+                                        paddle::platform::CPUPlace());
+  for (int i = 0; i < 9; ++i) {
+    ptr[i] = 1.0f;
+  }
+
+  reset_global_tape();
+  VariableHandle input(new Variable("input"));
+  get_global_tape().Feed(input, data);
+
+  // input is consumed twice, so both contributions must be summed
+  VariableHandle sum(new Variable("sum"));
+  get_global_tape().AddOp("elementwise_add",
+                          {{"X", {input}}, {"Y", {input}}},
+                          {{"Out", {sum}}},
+                          {{"axis", -1}});
+  Mean mean;
+  auto loss = mean(sum);
+  get_global_tape().Backward(loss);
+
+  auto &grad = input->Grad()->Var().Get<paddle::framework::LoDTensor>();
+  for (int i = 0; i < 9; ++i) {
+    EXPECT_FLOAT_EQ(2.0f / 9, grad.data<float>()[i]);
+  }
+}
+
+TEST(Tape, TestStopGradient) {
+  Linear linear1(3, 3, "relu");
+  Linear linear2(3, 3, "relu");
+  Mean mean;
+
+  // linear1 is a frozen feature extractor
+  for (auto w : linear1.Params()) {
+    w->SetStopGradient(true);
+  }
+
+  reset_global_tape();
+  auto loss = mean(linear2(linear1(FillInput())));
+  get_global_tape().Backward(loss);
+
+  for (auto w : linear1.Params()) {
+    EXPECT_FALSE(w->Grad()->Var().IsInitialized());
+  }
+  for (auto w : linear2.Params()) {
+    EXPECT_TRUE(w->Grad()->Var().IsInitialized());
+  }
+}
+
+TEST(Tape, TestReleaseIntermediates) {
+  Linear linear1(3, 3, "relu");
+  Linear linear2(3, 3, "relu");
+  Mean mean;
+
+  std::vector<VariableHandle> params = Params({&linear1, &linear2});
+  std::vector<std::vector<float>> before;
+  for (auto &w : params) {
+    before.push_back(Values(w));
+  }
+
+  reset_global_tape();
+  VariableHandle input = FillInput();
+  VariableHandle hidden = linear1(input);
+  VariableHandle out = linear2(hidden);
+  VariableHandle loss = mean(out);
+  // Only the tape holds the activations
+  std::vector<Variable *> activations = {hidden.get(), out.get()};
+  hidden.reset();
+  out.reset();
+  get_global_tape().Backward(loss);
+
+  for (auto *var : activations) {
+    EXPECT_FALSE(var->Var().IsInitialized()) << var->Name();
+    VariableHandle grad = var->ExistingGrad();
+    EXPECT_TRUE(grad == nullptr || !grad->Var().IsInitialized())
+        << var->Name();
+  }
+
+  // What the caller holds is intact
+  for (size_t i = 0; i < params.size(); ++i) {
+    EXPECT_EQ(before[i], Values(params[i]));
+    EXPECT_TRUE(params[i]->Grad()->Var().IsInitialized());
+  }
+  EXPECT_EQ(std::vector<float>(9, 1.0f), Values(input));
+  EXPECT_TRUE(loss->Var().IsInitialized());
+}
+
+TEST(Tape, TestCheckpointing) {
+  std::vector<Linear> layers;
+  for (int i = 0; i < 4; ++i) {
+    layers.emplace_back(3, 3, "relu");
+  }
+  Mean mean;
+
+  // Gradients without and with checkpointing must be identical
+  ExpectSameResults(
+      [&](bool checkpointing) {
+        reset_global_tape();
+        if (checkpointing) {
+          get_global_tape().EnableCheckpointing();
+        }
+
+        VariableHandle out = FillInput();
+        for (auto &layer : layers) {
+          out = layer(out);
+        }
+        get_global_tape().Backward(mean(out));
+
+        std::vector<float> grads;
+        for (auto &layer : layers) {
+          std::vector<float> grad = Grads(layer.Params());
+          grads.insert(grads.end(), grad.begin(), grad.end());
+        }
+        return grads;
+      },
+      0.0f);
+
+  // An activation used only inside its segment is released by Forward()
+  // and recomputed by Backward()
+  reset_global_tape();
+  VariableHandle input = FillInput();
+  get_global_tape().MarkCheckpoint();
+  VariableHandle interior(new Variable("interior"));
+  get_global_tape().AddOp(
+      "scale", {{"X", {input}}}, {{"Out", {interior}}}, {{"scale", 2.0f}});
+  VariableHandle boundary(new Variable("boundary"));
+  get_global_tape().AddOp("elementwise_mul",
+                          {{"X", {interior}}, {"Y", {interior}}},
+                          {{"Out", {boundary}}},
+                          {{"axis", -1}});
+  get_global_tape().MarkCheckpoint();
+  VariableHandle loss = mean(boundary);
+  Variable *activation = interior.get();
+  interior.reset();
+
+  get_global_tape().Forward();
+  EXPECT_FALSE(activation->Var().IsInitialized());
+  EXPECT_TRUE(boundary->Var().IsInitialized());
+
+  // d mean((2 x)^2) / dx = 8 x / 9
+  get_global_tape().Backward(loss);
+  for (float grad : Values(input->Grad())) EXPECT_FLOAT_EQ(8.0f / 9, grad);
+
+  // Recomputing a chain that could run in place reads what it was recorded
+  // with
+  reset_global_tape();
+  input = FillInput();
+  get_global_tape().MarkCheckpoint();
+  VariableHandle scaled(new Variable("scaled"));
+  get_global_tape().AddOp(
+      "scale", {{"X", {input}}}, {{"Out", {scaled}}}, {{"scale", 2.0f}});
+  VariableHandle activated(new Variable("activated"));
+  get_global_tape().AddOp(
+      "relu", {{"X", {scaled}}}, {{"Out", {activated}}}, {});
+  boundary.reset(new Variable("boundary"));
+  get_global_tape().AddOp(
+      "scale", {{"X", {activated}}}, {{"Out", {boundary}}}, {{"scale", 3.0f}});
+  get_global_tape().MarkCheckpoint();
+  loss = mean(boundary);
+  scaled.reset();
+  activated.reset();
+
+  // d mean(3 relu(2 x)) / dx = 6 / 9
+  get_global_tape().Backward(loss);
+  for (float grad : Values(input->Grad())) EXPECT_FLOAT_EQ(6.0f / 9, grad);
+}
+
+TEST(Tape, TestParallelExecution) {
+  Linear branch1(3, 3, "relu");
+  Linear branch2(3, 3, "sigmoid");
+  Mean mean;
+
+  // Parallel execution of two independent branches must match sequential
+  ExpectSameResults(
+      [&](bool parallel) {
+        reset_global_tape();
+        paddle::tape::ExecutionStrategy strategy;
+        strategy.num_threads = parallel ? 4 : 1;
+        get_global_tape().SetExecutionStrategy(strategy);
+
+        VariableHandle input = FillInput();
+        VariableHandle sum(new Variable("sum"));
+        get_global_tape().AddOp(
+            "elementwise_add",
+            {{"X", {branch1(input)}}, {"Y", {branch2(input)}}},
+            {{"Out", {sum}}},
+            {{"axis", -1}});
+        get_global_tape().Backward(mean(sum));
+        return Grads(Params({&branch1, &branch2}));
+      },
+      0.0f);
+}
+
+TEST(Tape, TestFusion) {
+  Linear linear1(3, 3, "tanh");
+  Linear linear2(3, 3, "relu");
+  Mean mean;
+
+  // Fused bias add and activation must match the Fluid ops
+  ExpectSameResultsWithFlag(&FLAGS_tape_fuse_elementwise, [&]() {
+    reset_global_tape();
+    VariableHandle loss = mean(linear2(linear1(FillInput())));
+    get_global_tape().Backward(loss);
+
+    std::vector<float> results = Values(loss);
+    std::vector<float> grads = Grads(Params({&linear1, &linear2}));
+    results.insert(results.end(), grads.begin(), grads.end());
+    return results;
+  });
+}
+
+TEST(Tape, TestThreadLocalTape) {
+  paddle::tape::Tape tape;
+  {
+    paddle::tape::TapeGuard guard(&tape);
+    EXPECT_EQ(&tape, &get_global_tape());
+  }
+  EXPECT_NE(&tape, &get_global_tape());
+
+  // Each thread records on its own tape
+  auto train = [] {
+    paddle::framework::LoDTensor data;
+    float *ptr = data.mutable_data<float>(paddle::framework::make_ddim({3, 3}),
+                                          paddle::platform::CPUPlace());
+    for (int i = 0; i < 9; ++i) {
+      ptr[i] = 1.0f;
+    }
+
+    for (int step = 0; step < 10; ++step) {
+      reset_global_tape();
+      VariableHandle input(new Variable("input"));
+      get_global_tape().Feed(input, data);
+      VariableHandle sum(new Variable("sum"));
+      get_global_tape().AddOp("elementwise_add",
+                              {{"X", {input}}, {"Y", {input}}},
+                              {{"Out", {sum}}},
+                              {{"axis", -1}});
+      Mean mean;
+      get_global_tape().Backward(mean(sum));
+
+      auto &grad = input->Grad()->Var().Get<paddle::framework::LoDTensor>();
+      for (int i = 0; i < 9; ++i) {
+        EXPECT_FLOAT_EQ(2.0f / 9, grad.data<float>()[i]);
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 4; ++i) {
+    threads.emplace_back(train);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+TEST(Tape, TestMultiTensorOptimizer) {
+  Linear linear1(3, 3, "relu");
+  Linear linear2(3, 3, "relu");
+  Mean mean;
+
+  reset_global_tape();
+  get_global_tape().Backward(mean(linear2(linear1(FillInput()))));
+
+  std::vector<std::vector<float>> params, grads;
+  for (auto w : Params({&linear1, &linear2})) {
+    params.push_back(Values(w));
+    grads.push_back(Values(w->Grad()));
+  }
+
+  paddle::tape::MultiTensorSGD sgd(0.1f, 4);
+  sgd.Update(linear1.Params());
+  // Steps are counted per parameter, not per Update()
+  paddle::tape::MultiTensorAdam adam(0.1f, 0.9f, 0.999f, 1e-8f, 4);
+  for (auto w : linear2.Params()) {
+    adam.Update({w});
+  }
+
+  // First step of Adam: m = (1 - beta1) g, v = (1 - beta2) g^2
+  float adam_lr = 0.1f * std::sqrt(1 - 0.999f) / (1 - 0.9f);
+  size_t k = 0;
+  for (auto *linear : {&linear1, &linear2}) {
+    for (auto w : linear->Params()) {
+      auto updated = Values(w);
+      for (size_t i = 0; i < updated.size(); ++i) {
+        float g = grads[k][i];
+        float expected = linear == &linear1
+                             ? params[k][i] - 0.1f * g
+                             : params[k][i] -
+                                   adam_lr * (1 - 0.9f) * g /
+                                       (std::sqrt((1 - 0.999f) * g * g) +
+                                        1e-8f);
+        EXPECT_NEAR(expected, updated[i], 1e-5);
+      }
+      ++k;
+    }
+  }
+
+  // Two steps of MultiTensorMomentum match those of the momentum op
+  for (bool nesterov : {false, true}) {
+    reset_global_tape();
+    get_global_tape().Backward(mean(linear2(linear1(FillInput()))));
+    std::vector<VariableHandle> ws = Params({&linear1, &linear2});
+
+    std::vector<VariableHandle> expected;
+    {
+      paddle::tape::Tape tape;
+      paddle::tape::TapeGuard guard(&tape);
+      paddle::framework::LoDTensor lr_data;
+      *lr_data.mutable_data<float>(paddle::framework::make_ddim({1}),
+                                   paddle::platform::CPUPlace()) = 0.1f;
+      VariableHandle lr(new Variable("lr"));
+      tape.Feed(lr, lr_data);
+      for (auto w : ws) {
+        auto &w_data = w->Var().Get<paddle::framework::LoDTensor>();
+        paddle::framework::LoDTensor zeros;
+        float *ptr = zeros.mutable_data<float>(w_data.dims(),
+                                               paddle::platform::CPUPlace());
+        std::fill(ptr, ptr + w_data.numel(), 0.0f);
+        VariableHandle param(new Variable("param"));
+        VariableHandle grad(new Variable("grad"));
+        VariableHandle velocity(new Variable("velocity"));
+        tape.Feed(param, w_data);
+        tape.Feed(grad, w->Grad()->Var().Get<paddle::framework::LoDTensor>());
+        tape.Feed(velocity, zeros);
+        for (int step = 0; step < 2; ++step) {
+          VariableHandle param_out(new Variable("param_out"));
+          VariableHandle velocity_out(new Variable("velocity_out"));
+          tape.AddOp("momentum",
+                     {{"Param", {param}},
+                      {"Grad", {grad}},
+                      {"Velocity", {velocity}},
+                      {"LearningRate", {lr}}},
+                     {{"ParamOut", {param_out}},
+                      {"VelocityOut", {velocity_out}}},
+                     {{"mu", 0.9f}, {"use_nesterov", nesterov}});
+          param = param_out;
+          velocity = velocity_out;
+        }
+        expected.push_back(param);
+      }
+      tape.Forward();
+    }
+
+    paddle::tape::MultiTensorMomentum momentum(0.1f, 0.9f, nesterov, 4);
+    momentum.Update(ws);
+    momentum.Update(ws);
+    for (size_t i = 0; i < ws.size(); ++i) {
+      std::vector<float> updated = Values(ws[i]);
+      std::vector<float> reference = Values(expected[i]);
+      ASSERT_EQ(reference.size(), updated.size());
+      for (size_t j = 0; j < updated.size(); ++j) {
+        EXPECT_NEAR(reference[j], updated[j], 1e-5) << nesterov;
+      }
+    }
+  }
+}
+
+TEST(Tape, TestParameterStore) {
+  Linear linear1(3, 3, "relu");
+  Linear linear2(3, 3, "relu");
+  Mean mean;
+
+  std::vector<VariableHandle> params = Params({&linear1, &linear2});
+  std::vector<std::vector<float>> before;
+  for (auto w : params) {
+    before.push_back(Values(w));
+  }
+
+  paddle::tape::ParameterStore store(params);
+  auto &flat = store.FlatParam()->Var().Get<paddle::framework::LoDTensor>();
+  for (size_t i = 0; i < params.size(); ++i) {
+    // Parameters keep their values and become views of the buffer
+    EXPECT_EQ(before[i], Values(params[i]));
+    const float *data =
+        params[i]->Var().Get<paddle::framework::LoDTensor>().data<float>();
+    EXPECT_TRUE(data >= flat.data<float>() &&
+                data < flat.data<float>() + flat.numel());
+  }
+
+  reset_global_tape();
+  get_global_tape().Backward(mean(linear2(linear1(FillInput()))));
+
+  // Gradients are written into the gradient buffer
+  std::vector<std::vector<float>> grads;
+  double sum = 0;
+  for (auto w : params) {
+    grads.push_back(Values(w->Grad()));
+    for (float g : grads.back()) {
+      sum += g * g;
+    }
+  }
+  EXPECT_NEAR(std::sqrt(sum), store.GradNorm(), 1e-5);
+
+  std::stringstream checkpoint;
+  store.Save(checkpoint);
+
+  // One update over the whole buffer updates every parameter
+  paddle::tape::MultiTensorSGD sgd(0.1f);
+  sgd.Update({store.FlatParam()});
+  for (size_t i = 0; i < params.size(); ++i) {
+    auto updated = Values(params[i]);
+    for (size_t j = 0; j < updated.size(); ++j) {
+      EXPECT_NEAR(before[i][j] - 0.1f * grads[i][j], updated[j], 1e-6);
+    }
+  }
+
+  store.ZeroGrad();
+  EXPECT_EQ(0.0f, store.GradNorm());
+  store.Load(checkpoint);
+  for (size_t i = 0; i < params.size(); ++i) {
+    EXPECT_EQ(before[i], Values(params[i]));
+  }
+}
+
+TEST(Tape, TestAsync) {
+  Linear linear1(3, 3, "relu");
+  Linear linear2(3, 3, "sigmoid");
+  Mean mean;
+
+  // Running the ops on the background thread must not change the results.
+  // Async ops are not fused.
+  ExpectSameResults([&](bool async) {
+    reset_global_tape();
+    if (async) get_global_tape().EnableAsync();
+
+    VariableHandle hidden = linear1(FillInput());
+    hidden->value();
+    std::vector<float> results = Values(hidden);
+
+    get_global_tape().Backward(mean(linear2(hidden)));
+    std::vector<float> grads = Grads(Params({&linear1, &linear2}));
+    results.insert(results.end(), grads.begin(), grads.end());
+    return results;
+  });
+}
+
+TEST(Tape, TestInplace) {
+  reset_global_tape();
+  VariableHandle input = FillInput();
+  VariableHandle doubled(new Variable("doubled"));
+  get_global_tape().AddOp(
+      "scale", {{"X", {input}}}, {{"Out", {doubled}}}, {{"scale", 2.0f}});
+  VariableHandle out(new Variable("out"));
+  get_global_tape().AddOp(
+      "scale", {{"X", {doubled}}}, {{"Out", {out}}}, {{"scale", 3.0f}});
+
+  // Only the tape holds doubled, so out takes over its storage
+  Variable *intermediate = doubled.get();
+  doubled.reset();
+  get_global_tape().Forward();
+
+  auto &result = out->Var().Get<paddle::framework::LoDTensor>();
+  for (int i = 0; i < 9; ++i) {
+    EXPECT_FLOAT_EQ(6.0f, result.data<float>()[i]);
+  }
+  EXPECT_EQ(1UL, intermediate->Version());
+  EXPECT_EQ(
+      intermediate->Var().Get<paddle::framework::LoDTensor>().data<float>(),
+      result.data<float>());
+  // input is written by the tape and held by the test
+  EXPECT_EQ(0UL, input->Version());
+}
+
+TEST(Tape, TestMemoryPlan) {
+  Linear linear1(3, 3, "relu");
+  Linear linear2(3, 3, "relu");
+  Mean mean;
+
+  reset_global_tape();
+  VariableHandle input(new Variable("input"));
+  get_global_tape().Feed(input, InputData());
+  auto loss = mean(linear2(linear1(input)));
+  get_global_tape().Backward(loss);
+
+  std::vector<VariableHandle> params = Params({&linear1, &linear2});
+  auto snapshot = [&loss, &params]() {
+    std::vector<float> values = Values(loss);
+    std::vector<float> grads = Grads(params);
+    values.insert(values.end(), grads.begin(), grads.end());
+    return values;
+  };
+  std::vector<float> recorded = snapshot();
+
+  // The intermediates of both tapes now live in the arenas of the plan
+  get_global_tape().Freeze();
+  EXPECT_GT(get_global_tape().PlannedMemoryBytes(), 0UL);
+
+  for (int i = 0; i < 2; ++i) {
+    get_global_tape().Replay();
+    std::vector<float> replayed = snapshot();
+    ASSERT_EQ(recorded.size(), replayed.size());
+    for (size_t j = 0; j < recorded.size(); ++j) {
+      EXPECT_FLOAT_EQ(recorded[j], replayed[j]);
+    }
+  }
+
+  // The plan of a tape frozen before Backward() has no room for grad ops
+  reset_global_tape();
+  loss = mean(linear2(linear1(FillInput())));
+  get_global_tape().Forward();
+  get_global_tape().Freeze();
+  EXPECT_THROW(get_global_tape().Backward(loss),
+               paddle::platform::EnforceNotMet);
+}
+
+TEST(Tape, TestNoGrad) {
+  Linear linear1(3, 3, "relu");
+  Linear linear2(3, 3, "relu");
+  Mean mean;
+
+  reset_global_tape();
+  VariableHandle input = FillInput();
+  auto recorded = linear2(linear1(input));
+  get_global_tape().Forward();
+
+  {
+    paddle::tape::NoGradGuard guard;
+    EXPECT_FALSE(paddle::tape::IsGradEnabled());
+    // Nothing but the caller holds the output of an op
+    std::weak_ptr<Variable> hidden = linear1(input);
+    EXPECT_TRUE(hidden.expired());
+
+    // Run without Forward()
+    auto eager = linear2(linear1(input));
+    std::vector<float> expected = Values(recorded);
+    std::vector<float> result = Values(eager);
+    ASSERT_EQ(expected.size(), result.size());
+    for (size_t i = 0; i < result.size(); ++i) {
+      EXPECT_FLOAT_EQ(expected[i], result[i]);
+    }
+  }
+  EXPECT_TRUE(paddle::tape::IsGradEnabled());
+
+  // Backward() records its grad ops under a NoGradGuard as well
+  bool cache_backward = FLAGS_tape_cache_backward;
+  FLAGS_tape_cache_backward = false;
+  ExpectSameResults([&](bool no_grad) {
+    reset_global_tape();
+    VariableHandle loss = mean(linear2(linear1(FillInput())));
+    std::unique_ptr<paddle::tape::NoGradGuard> guard;
+    if (no_grad) guard.reset(new paddle::tape::NoGradGuard());
+    get_global_tape().Backward(loss);
+    return Grads(Params({&linear1, &linear2}));
+  });
+  FLAGS_tape_cache_backward = cache_backward;
+}
+
+TEST(Tape, TestSaveLoad) {
+  Linear linear1(3, 3, "relu");
+  Linear linear2(3, 3, "relu");
+  Mean mean;
+
+  paddle::framework::LoDTensor data = InputData();
+
+  reset_global_tape();
+  VariableHandle input(new Variable("input"));
+  get_global_tape().Feed(input, data);
+  auto loss = mean(linear2(linear1(input)));
+  get_global_tape().Backward(loss);
+
+  std::map<std::string, VariableHandle> bindings = {{"input", input},
+                                                    {"loss", loss}};
+  std::vector<VariableHandle> params = Params({&linear1, &linear2});
+  for (size_t i = 0; i < params.size(); ++i) {
+    bindings["param" + std::to_string(i)] = params[i];
+  }
+  std::stringstream stream;
+  get_global_tape().Save(stream, bindings);
+
+  std::map<std::string, VariableHandle> loaded;
+  paddle::tape::Tape tape = paddle::tape::Tape::Load(stream, &loaded);
+  ASSERT_EQ(bindings.size(), loaded.size());
+  EXPECT_TRUE(tape.IsFrozen());
+  tape.Feed(loaded["input"], data);
+  tape.Replay();
+
+  auto expect_equal = [](const VariableHandle &a, const VariableHandle &b) {
+    std::vector<float> x = Values(a);
+    std::vector<float> y = Values(b);
+    ASSERT_EQ(x.size(), y.size());
+    for (size_t i = 0; i < x.size(); ++i) {
+      EXPECT_FLOAT_EQ(x[i], y[i]);
+    }
+  };
+  expect_equal(loss, loaded["loss"]);
+  for (size_t i = 0; i < params.size(); ++i) {
+    auto &param = loaded["param" + std::to_string(i)];
+    EXPECT_NE(params[i]->Name(), param->Name());
+    expect_equal(params[i], param);
+    expect_equal(params[i]->Grad(), param->Grad());
+  }
+}
+
+TEST(Tape, TestBackwardCache) {
+  Linear linear1(3, 3, "relu");
+  Linear linear2(3, 3, "relu");
+  Mean mean;
+
+  std::vector<VariableHandle> params = Params({&linear1, &linear2});
+  auto step = [&](std::vector<int> shape) {
+    reset_global_tape();
+    auto loss = mean(linear2(linear1(FillInput(shape))));
+    get_global_tape().Backward(loss);
+    return Grads(params);
+  };
+  auto &cache = paddle::tape::BackwardCache::Instance();
+
+  std::vector<float> expected = step({3, 3});
+  size_t cached = cache.Size();
+
+  // Same structure, so the backward tape is rebound from the cache
+  ExpectSameResultsWithFlag(
+      &FLAGS_tape_cache_backward, [&]() { return step({3, 3}); }, 0.0f);
+  EXPECT_EQ(cached, cache.Size());
+
+  // Beyond its capacity the least recently used template is evicted
+  int capacity = FLAGS_tape_backward_cache_capacity;
+  FLAGS_tape_backward_cache_capacity = 1;
+  step({2, 3});
+  EXPECT_EQ(1UL, cache.Size());
+  EXPECT_EQ(expected, step({3, 3}));
+  EXPECT_EQ(1UL, cache.Size());
+  FLAGS_tape_backward_cache_capacity = capacity;
+}
+
+TEST(Tape, TestPartialEvaluation) {
+  reset_global_tape();
+  VariableHandle input = FillInput();
+  VariableHandle used(new Variable("used"));
+  get_global_tape().AddOp(
+      "scale", {{"X", {input}}}, {{"Out", {used}}}, {{"scale", 2.0f}});
+  VariableHandle pending(new Variable("pending"));
+  get_global_tape().AddOp(
+      "scale", {{"X", {input}}}, {{"Out", {pending}}}, {{"scale", 3.0f}});
+  VariableHandle dead(new Variable("dead"));
+  get_global_tape().AddOp(
+      "scale", {{"X", {pending}}}, {{"Out", {dead}}}, {{"scale", 4.0f}});
+
+  // Only the producers of used are run
+  used->value();
+  EXPECT_FLOAT_EQ(2.0f, Values(used)[0]);
+  EXPECT_FALSE(pending->Var().IsInitialized());
+  pending->value();
+  EXPECT_FLOAT_EQ(3.0f, Values(pending)[0]);
+
+  // Neither dead nor metric lead to the target of Backward(), metric reads
+  // an intermediate of it
+  Mean mean;
+  VariableHandle hidden(new Variable("hidden"));
+  get_global_tape().AddOp(
+      "scale", {{"X", {used}}}, {{"Out", {hidden}}}, {{"scale", 5.0f}});
+  VariableHandle loss = mean(hidden);
+  VariableHandle metric(new Variable("metric"));
+  get_global_tape().AddOp(
+      "scale", {{"X", {hidden}}}, {{"Out", {metric}}}, {{"scale", 0.5f}});
+  hidden.reset();
+  get_global_tape().Backward(loss);
+  EXPECT_FALSE(dead->Var().IsInitialized());
+  EXPECT_FALSE(metric->Var().IsInitialized());
+
+  // The intermediate is kept for metric
+  metric->value();
+  EXPECT_FLOAT_EQ(5.0f, Values(metric)[0]);
+}
+
+TEST(Tape, TestConstantCache) {
+  reset_global_tape();
+  VariableHandle a = FillInput({3, 3}, 7.0f);
+  VariableHandle b = FillInput({3, 3}, 7.0f);
+  get_global_tape().Forward();
+
+  // b shares the result computed for a
+  auto data = [](const VariableHandle &var) {
+    return var->Var().Get<paddle::framework::LoDTensor>().data<float>();
+  };
+  EXPECT_EQ(data(a), data(b));
+  EXPECT_TRUE(paddle::tape::ConstantCache::Instance().Holds(*a));
+
+  // Overwriting a leaves the cached result alone
+  reset_global_tape();
+  get_global_tape().AddOp(
+      "scale", {{"X", {a}}}, {{"Out", {a}}}, {{"scale", 2.0f}});
+  get_global_tape().Forward();
+  EXPECT_NE(data(a), data(b));
+  EXPECT_FLOAT_EQ(14.0f, data(a)[0]);
+  EXPECT_FLOAT_EQ(7.0f, data(b)[0]);
+  EXPECT_FALSE(a->SharesConstant());
+  EXPECT_TRUE(b->SharesConstant());
+
+  reset_global_tape();
+  VariableHandle c = FillInput({3, 3}, 7.0f);
+  get_global_tape().Forward();
+  EXPECT_EQ(data(b), data(c));
+
+  // Beyond its capacity the least recently used result is evicted, the
+  // Variables sharing it keep its data
+  auto &cache = paddle::tape::ConstantCache::Instance();
+  int capacity = FLAGS_tape_constant_cache_capacity;
+  FLAGS_tape_constant_cache_capacity = 1;
+  reset_global_tape();
+  VariableHandle d = FillInput({3, 3}, 8.0f);
+  get_global_tape().Forward();
+  EXPECT_EQ(1UL, cache.Size());
+  EXPECT_TRUE(cache.Holds(*c));
+
+  reset_global_tape();
+  VariableHandle e = FillInput({3, 3}, 7.0f);
+  get_global_tape().Forward();
+  EXPECT_EQ(1UL, cache.Size());
+  EXPECT_NE(data(c), data(e));
+  EXPECT_FLOAT_EQ(7.0f, data(c)[0]);
+  EXPECT_FLOAT_EQ(7.0f, data(e)[0]);
+  EXPECT_FLOAT_EQ(8.0f, data(d)[0]);
+  FLAGS_tape_constant_cache_capacity = capacity;
+}
+
+TEST(Tape, TestCommonSubexpressionElimination) {
+  Linear projection(3, 3, "relu");
+  Mean mean;
+
+  // Two heads on the same projection of the input
+  VariableHandle head1, head2;
+  ExpectSameResultsWithFlag(&FLAGS_tape_cse, [&]() {
+    reset_global_tape();
+    VariableHandle input = FillInput();
+    head1 = projection(input);
+    head2 = projection(input);
+    VariableHandle sum(new Variable("sum"));
+    get_global_tape().AddOp("elementwise_add",
+                            {{"X", {head1}}, {"Y", {head2}}},
+                            {{"Out", {sum}}},
+                            {{"axis", -1}});
+    get_global_tape().Backward(mean(sum));
+    return Grads(projection.Params());
+  });
+
+  // With the flag on, the second head shares the result of the first
+  auto &value1 = head1->Var().Get<paddle::framework::LoDTensor>();
+  auto &value2 = head2->Var().Get<paddle::framework::LoDTensor>();
+  EXPECT_EQ(value1.data<float>(), value2.data<float>());
+
+  // An op of a later Forward() does not run in place of the output of an
+  // eliminated op, whose data is that of the first op
+  ExpectSameResultsWithFlag(&FLAGS_tape_cse, []() {
+    reset_global_tape();
+    VariableHandle input = FillInput();
+    VariableHandle first(new Variable("first"));
+    get_global_tape().AddOp(
+        "scale", {{"X", {input}}}, {{"Out", {first}}}, {{"scale", 2.0f}});
+    VariableHandle second(new Variable("second"));
+    get_global_tape().AddOp(
+        "scale", {{"X", {input}}}, {{"Out", {second}}}, {{"scale", 2.0f}});
+    get_global_tape().Forward();
+
+    VariableHandle out(new Variable("out"));
+    get_global_tape().AddOp(
+        "scale", {{"X", {second}}}, {{"Out", {out}}}, {{"scale", 3.0f}});
+    second.reset();
+    get_global_tape().Forward();
+
+    std::vector<float> values = Values(first);
+    std::vector<float> result = Values(out);
+    values.insert(values.end(), result.begin(), result.end());
+    return values;
+  });
+}
+
 int main(int argc, char **argv) {
   std::vector<paddle::platform::Place> places;
   places.emplace_back(paddle::platform::CPUPlace());
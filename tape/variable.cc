@@ -14,11 +14,59 @@
 
 #include "tape/variable.h"
 
+#include <algorithm>
+
 namespace paddle {
 namespace tape {
 
+VariableHandleMap::VariableHandleMap(std::initializer_list<value_type> params)
+    : params_(params) {
+  std::sort(params_.begin(),
+            params_.end(),
+            [](const value_type& a, const value_type& b) {
+              return a.first < b.first;
+            });
+  for (size_t i = 1; i < params_.size(); ++i) {
+    PADDLE_ENFORCE(params_[i - 1].first != params_[i].first,
+                   "Duplicated parameter %s",
+                   params_[i].first);
+  }
+}
+
+std::vector<VariableHandle>& VariableHandleMap::operator[](
+    const std::string& param) {
+  auto it = params_.begin();
+  while (it != params_.end() && it->first < param) ++it;
+  if (it == params_.end() || it->first != param) {
+    it = params_.emplace(it, param, std::vector<VariableHandle>());
+  }
+  return it->second;
+}
+
+const std::vector<VariableHandle>& VariableHandleMap::at(
+    const std::string& param) const {
+  auto it = find(param);
+  PADDLE_ENFORCE(it != end(), "No parameter %s", param);
+  return it->second;
+}
+
+VariableHandleMap::iterator VariableHandleMap::find(const std::string& param) {
+  for (auto it = params_.begin(); it != params_.end(); ++it) {
+    if (it->first == param) return it;
+  }
+  return params_.end();
+}
+
+VariableHandleMap::const_iterator VariableHandleMap::find(
+    const std::string& param) const {
+  for (auto it = params_.begin(); it != params_.end(); ++it) {
+    if (it->first == param) return it;
+  }
+  return params_.end();
+}
+
 std::ostream& operator<<(std::ostream& os, const Variable& var) {
-  LOG(INFO) << "Printing " << var.Name();
+  VLOG(10) << "Printing " << var.Name();
   framework::proto::VarType::Type var_type = var.Desc().GetType();
   if (var_type == framework::proto::VarType::LOD_TENSOR) {
     os << var.Var().Get<framework::LoDTensor>();
@@ -29,7 +77,7 @@ std::ostream& operator<<(std::ostream& os, const Variable& var) {
 }
 
 void Variable::InitializeVariable() {
-  LOG(INFO) << "Initialzing " << desc_.Name() << " as " << desc_.GetType();
+  VLOG(10) << "Initialzing " << desc_.Name() << " as " << desc_.GetType();
   framework::proto::VarType::Type var_type = desc_.GetType();
   if (var_type == framework::proto::VarType::LOD_TENSOR) {
     var_.GetMutable<framework::LoDTensor>();
@@ -42,7 +90,8 @@ void Variable::InitializeVariable() {
 }
 
 const Variable& Variable::value() {
-  get_global_tape().Forward();
+  // The tape recording this Variable must be current on the calling thread
+  get_global_tape().Evaluate(this);
   return *this;
 }
 
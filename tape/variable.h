@@ -13,8 +13,13 @@
 // limitations under the License.
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <initializer_list>
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "paddle/fluid/framework/operator.h"  // framework::kGradVarSuffix
 #include "paddle/fluid/framework/program_desc.h"
@@ -26,6 +31,43 @@ namespace tape {
 class Variable;
 using VariableHandle = std::shared_ptr<Variable>;
 
+/*
+ * Arguments of an op by parameter name, iterated in the order of the names
+ * like a std::map.
+ *
+ * An op has a handful of parameters, so they are kept sorted in a single
+ * vector instead of one tree node each. Lookups are linear scans.
+ */
+class VariableHandleMap {
+ public:
+  using value_type = std::pair<std::string, std::vector<VariableHandle>>;
+  using iterator = std::vector<value_type>::iterator;
+  using const_iterator = std::vector<value_type>::const_iterator;
+
+  VariableHandleMap() = default;
+  VariableHandleMap(std::initializer_list<value_type> params);
+
+  // Inserts an empty argument list for a new param
+  std::vector<VariableHandle>& operator[](const std::string& param);
+  const std::vector<VariableHandle>& at(const std::string& param) const;
+
+  iterator find(const std::string& param);
+  const_iterator find(const std::string& param) const;
+  size_t count(const std::string& param) const {
+    return find(param) != end() ? 1 : 0;
+  }
+
+  iterator begin() { return params_.begin(); }
+  iterator end() { return params_.end(); }
+  const_iterator begin() const { return params_.begin(); }
+  const_iterator end() const { return params_.end(); }
+  size_t size() const { return params_.size(); }
+  bool empty() const { return params_.empty(); }
+
+ private:
+  std::vector<value_type> params_;
+};
+
 std::ostream& operator<<(std::ostream&, const Variable&);
 
 /*
@@ -36,13 +78,14 @@ std::ostream& operator<<(std::ostream&, const Variable&);
 class Variable {
  public:
   explicit Variable(const std::string pre_fix)
-      : desc_(pre_fix + std::to_string(count())) {}
+      : id_(NextId()), desc_(pre_fix + std::to_string(id_)) {}
 
   Variable(const std::string pre_fix, bool is_grad)
-      : desc_(pre_fix + (is_grad ? framework::kGradVarSuffix
-                                 : std::to_string(count()))) {}
+      : id_(NextId()),
+        desc_(pre_fix + (is_grad ? framework::kGradVarSuffix
+                                 : std::to_string(id_))) {}
 
-  ~Variable() { LOG(INFO) << "Deleting " << Name(); }
+  ~Variable() { VLOG(10) << "Deleting " << Name(); }
 
   // Instantiate LoDTensor/SelectedRow
   void InitializeVariable();
@@ -57,13 +100,21 @@ class Variable {
     }
   }
 
+  // The gradient if it has been created, nullptr otherwise
+  VariableHandle ExistingGrad() const { return grad_.lock(); }
+
+  // No gradient is computed for a Variable with stop_gradient set, nor for
+  // the Variables computed only from such Variables.
+  void SetStopGradient(bool stop_gradient) { stop_gradient_ = stop_gradient; }
+  bool StopGradient() const { return stop_gradient_; }
+
   // Stochastic Gradient Descent with Momentum
   //  VariableHandle Momentum ();
 
   //  void init(const std::string& initializer,
   //            const framework::AttributeMap& attrs);
 
-  // Evaluate a variable by running Forward() on the global tape
+  // Evaluate a variable on the global tape, see Tape::Evaluate()
   const Variable& value();
 
   const framework::VarDesc& Desc() const { return desc_; }
@@ -72,18 +123,39 @@ class Variable {
   // TODO(tonyyang-svail): No need to expose name
   std::string Name() const { return desc_.Name(); }
 
+  // Unique among the Variables of the process
+  int64_t Id() const { return id_; }
+
+  // Bumped every time an op overwrites the storage of this Variable in place
+  // of one of its outputs. An op recorded at an older version would read
+  // clobbered data.
+  uint64_t Version() const { return version_; }
+  void BumpVersion() { ++version_; }
+
+  // Whether the data may be shared with a result of the ConstantCache, set
+  // along with the data and cleared when the Variable is given storage of
+  // its own.
+  bool SharesConstant() const { return shares_constant_; }
+  void SetSharesConstant(bool shares) { shares_constant_ = shares; }
+
   const framework::Variable& Var() const { return var_; }
   framework::Variable* MutableVar() { return &var_; }
 
  private:
-  int count() {
-    static int counter = 0;
-    return counter++;
+  // Safe to call from any thread
+  static int64_t NextId() {
+    static std::atomic<int64_t> counter(0);
+    return counter.fetch_add(1, std::memory_order_relaxed);
   }
 
+  int64_t id_;
   framework::VarDesc desc_;
   framework::Variable var_;
 
+  bool stop_gradient_ = false;
+  uint64_t version_ = 0;
+  bool shares_constant_ = false;
+
   // Not own
   std::weak_ptr<Variable> grad_;
 };